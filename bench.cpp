@@ -0,0 +1,39 @@
+#include <chrono>
+#include <iostream>
+
+#include "lua_wrapper.hpp"
+
+using namespace neko::luabind;
+
+struct BenchStruct {
+    float x, y, z, w;
+    int x1, x2;
+};
+
+int main() {
+    {
+        // 分配器对比: 大量结构体代理 字符串与小表的创建与回收
+        for (auto policy : {LuaAllocPolicy::System, LuaAllocPolicy::Pool}) {
+            LuaVM bench;
+            lua_State *B = bench.Create(policy);
+            lua_newtable(B);
+            LuaStruct<BenchStruct>(B, "BenchStruct");
+            lua_setglobal(B, "LuaStruct");
+            auto t0 = std::chrono::steady_clock::now();
+            bench.RunString(R"lua(
+            local live = {}
+            for i = 1, 200000 do
+                local v = LuaStruct.BenchStruct.new()
+                v.x = i
+                live[i % 1024 + 1] = {v, tostring(i), {i}}
+            end
+        )lua");
+            auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            const LuaMemStats &st = bench.MemStats();
+            std::cout << "alloc bench " << (policy == LuaAllocPolicy::Pool ? "pool" : "system") << " " << ms << "ms peak " << st.peak << std::endl;
+            bench.Fini(B);
+        }
+    }
+
+    return 0;
+}
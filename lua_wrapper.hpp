@@ -1,15 +1,34 @@
 #if !defined(NEKO_LUA_WRAPPER_HPP)
 #define NEKO_LUA_WRAPPER_HPP
 
+#include <algorithm>
+#include <atomic>
 #include <bit>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdarg>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <ranges>
+#include <span>
 #include <string>
+#include <thread>
 #include <tuple>  // std::ignore
 #include <typeindex>
+#include <unordered_map>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -18,6 +37,17 @@
 #include "luax.h"
 #include "utils.hpp"
 
+// 绑定层的错误策略 以 -fno-exceptions 编译时为 0
+// 绑定函数通过负返回值报告错误 lua_error 只在 Wrap 中抛出 参数在转换前统一校验
+// 校验覆盖数值 字符串 枚举 LuaStruct 与 LuaClass 参数 容器等其他类型在转换时仍可能抛出 Lua 错误
+#if !defined(NEKO_LUA_EXCEPTIONS)
+#if defined(__cpp_exceptions) || defined(_CPPUNWIND)
+#define NEKO_LUA_EXCEPTIONS 1
+#else
+#define NEKO_LUA_EXCEPTIONS 0
+#endif
+#endif
+
 namespace std {
 template <typename E, typename = std::enable_if_t<std::is_enum_v<E>>>
 constexpr std::underlying_type_t<E> to_underlying(E e) noexcept {
@@ -863,6 +893,193 @@ private:
     int m_count;
 };
 
+// 从 i + 1 开始把 range 依次写入 t 的数组部分 返回最后写入的下标
+// 连续存储的数值序列直接走 lua_pushinteger/lua_pushnumber 紧凑循环
+template <typename Range>
+inline lua_Integer RawSetRange(lua_State *L, int t, lua_Integer i, Range &&range) {
+    using V = std::ranges::range_value_t<Range>;
+    if constexpr (std::ranges::contiguous_range<Range> && std::is_arithmetic_v<V> && !std::is_same_v<V, bool>) {
+        const V *p = std::ranges::data(range);
+        const V *e = p + std::ranges::size(range);
+        for (; p != e; ++p) {
+            if constexpr (std::is_integral_v<V>) {
+                lua_pushinteger(L, static_cast<lua_Integer>(*p));
+            } else {
+                lua_pushnumber(L, static_cast<lua_Number>(*p));
+            }
+            lua_rawseti(L, t, ++i);
+        }
+    } else {
+        for (auto &&v : range) {
+            LuaStack::Push(L, v);
+            lua_rawseti(L, t, ++i);
+        }
+    }
+    return i;
+}
+
+}  // namespace detail
+
+// 受保护调用失败时的错误信息 只在失败路径上构造
+struct LuaError {
+    int status;
+    std::string msg;
+};
+
+// 类似 std::expected 的调用结果 成功路径不分配内存
+template <typename T>
+class LuaResult {
+public:
+    LuaResult(T v) : m_v(std::in_place_index<0>, std::move(v)) {}
+    LuaResult(LuaError e) : m_v(std::in_place_index<1>, std::move(e)) {}
+
+    bool has_value() const noexcept { return m_v.index() == 0; }
+    explicit operator bool() const noexcept { return has_value(); }
+
+    T &value() { return std::get<0>(m_v); }
+    const T &value() const { return std::get<0>(m_v); }
+    T &operator*() { return value(); }
+    const T &operator*() const { return value(); }
+    T *operator->() { return &value(); }
+    const T *operator->() const { return &value(); }
+
+    template <typename U>
+    T value_or(U &&def) const {
+        return has_value() ? value() : static_cast<T>(std::forward<U>(def));
+    }
+
+    const LuaError &error() const { return std::get<1>(m_v); }
+
+private:
+    std::variant<T, LuaError> m_v;
+};
+
+template <>
+class LuaResult<void> {
+public:
+    LuaResult() = default;
+    LuaResult(LuaError e) : m_err(std::move(e)), m_ok(false) {}
+
+    bool has_value() const noexcept { return m_ok; }
+    explicit operator bool() const noexcept { return m_ok; }
+
+    const LuaError &error() const { return m_err; }
+
+private:
+    LuaError m_err{LUA_OK, {}};
+    bool m_ok = true;
+};
+
+// 异步操作的共享状态 可在任意线程完成 完成回调在完成的线程上执行
+template <typename R>
+struct LuaAsyncState {
+    using Value = std::conditional_t<std::is_void_v<R>, std::monostate, R>;
+
+    std::mutex mutex;
+    bool ready = false;
+    std::optional<Value> value;
+    std::string error;
+    std::function<void()> then;
+
+    void Settle() {
+        std::function<void()> fn;
+        {
+            std::lock_guard lock(mutex);
+            ready = true;
+            fn = std::move(then);
+        }
+        if (fn) fn();
+    }
+
+    // 已完成时立即调用 fn
+    void Then(std::function<void()> fn) {
+        {
+            std::lock_guard lock(mutex);
+            if (!ready) {
+                then = std::move(fn);
+                return;
+            }
+        }
+        fn();
+    }
+};
+
+template <typename R = void>
+class LuaFuture {
+public:
+    LuaFuture() = default;
+    explicit LuaFuture(std::shared_ptr<LuaAsyncState<R>> state) : m_state(std::move(state)) {}
+
+    bool Ready() const {
+        std::lock_guard lock(m_state->mutex);
+        return m_state->ready;
+    }
+
+    const std::shared_ptr<LuaAsyncState<R>> &State() const { return m_state; }
+
+private:
+    std::shared_ptr<LuaAsyncState<R>> m_state;
+};
+
+// 由执行异步操作的一方持有 Resolve/Reject 只应调用一次
+template <typename R = void>
+class LuaPromise {
+public:
+    LuaPromise() : m_state(std::make_shared<LuaAsyncState<R>>()) {}
+
+    LuaFuture<R> GetFuture() const { return LuaFuture<R>(m_state); }
+
+    template <typename... V>
+    void Resolve(V &&...v) {
+        {
+            std::lock_guard lock(m_state->mutex);
+            m_state->value.emplace(std::forward<V>(v)...);
+        }
+        m_state->Settle();
+    }
+
+    void Reject(std::string msg) {
+        {
+            std::lock_guard lock(m_state->mutex);
+            m_state->error = std::move(msg);
+        }
+        m_state->Settle();
+    }
+
+private:
+    std::shared_ptr<LuaAsyncState<R>> m_state;
+};
+
+// 弹出栈顶的错误对象
+inline LuaError LuaPopError(lua_State *L, int status) {
+    size_t len = 0;
+    const char *msg = lua_tolstring(L, -1, &len);
+    LuaError err{status, msg ? std::string(msg, len) : std::string(luaL_typename(L, -1))};
+    lua_pop(L, 1);
+    return err;
+}
+
+// 使用缓存的 traceback 处理函数调用栈顶函数 失败时栈上只移除函数与参数
+inline LuaResult<void> LuaCall(lua_State *L, int nargs, int nresults) {
+    int status = luax_xpcall(L, nargs, nresults);
+    if (status != LUA_OK) {
+        return LuaPopError(L, status);
+    }
+    return {};
+}
+
+// LuaReset 的次数 注册表恢复到重置点后 之前创建的引用槽位可能已分给别的持有者
+// 引用包装记录创建时的值 不一致时析构不再释放槽位
+inline u32 LuaRefGeneration(lua_State *L);
+
+namespace detail {
+
+inline void UnrefChecked(lua_State *L, int ref, u32 gen) {
+    if (ref >= 0 && LuaRefGeneration(L) == gen) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    }
+}
+
 }  // namespace detail
 
 class LuaRef;
@@ -871,12 +1088,19 @@ class LuaRefBase {
 protected:
     lua_State *L;
     int m_ref;
+    u32 m_gen = 0;
     struct FromStackIndex {};
 
     // 不应该直接使用
-    explicit LuaRefBase(lua_State *L, FromStackIndex) : L(L) { m_ref = luaL_ref(L, LUA_REGISTRYINDEX); }
+    explicit LuaRefBase(lua_State *L, FromStackIndex) : L(L) { Ref(); }
     explicit LuaRefBase(lua_State *L, int ref) : L(L), m_ref(ref) {}
-    ~LuaRefBase() { luaL_unref(L, LUA_REGISTRYINDEX, m_ref); }
+    ~LuaRefBase() { detail::UnrefChecked(L, m_ref, m_gen); }
+
+    // 弹出栈顶的值作为引用
+    void Ref() {
+        m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        if (m_ref >= 0) m_gen = LuaRefGeneration(L);
+    }
 
 public:
     virtual void Push() const { lua_rawgeti(L, LUA_REGISTRYINDEX, m_ref); }
@@ -923,6 +1147,15 @@ public:
         lua_pop(L, 1);
     }
 
+    // 批量追加 只取一次长度
+    template <std::ranges::input_range Range>
+    void AppendRange(Range &&range) const {
+        Push();
+        int t = lua_gettop(L);
+        detail::RawSetRange(L, t, (lua_Integer)lua_rawlen(L, t), std::forward<Range>(range));
+        lua_pop(L, 1);
+    }
+
     template <typename T>
     T Cast() {
         detail::StackGuard p(L);
@@ -985,6 +1218,9 @@ auto Push(lua_State *L, LuaTableElement<T> const &e) {
 class LuaRef : public LuaRefBase {
     friend LuaRefBase;
     friend void DumpLuaRef(const LuaRef &ref);
+    template <typename Sig>
+    friend class LuaFunction;
+    friend class WeakLuaRef;
 
 private:
     explicit LuaRef(lua_State *L, FromStackIndex fs) : LuaRefBase(L, fs) {}
@@ -996,49 +1232,53 @@ public:
 
     LuaRef(lua_State *L, const std::string &global) : LuaRefBase(L, LUA_REFNIL) {
         lua_getglobal(L, global.c_str());
-        m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        Ref();
     }
 
     LuaRef(LuaRef const &other) : LuaRefBase(other.L, LUA_REFNIL) {
         other.Push();
-        m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        Ref();
     }
 
-    LuaRef(LuaRef &&other) noexcept : LuaRefBase(other.L, other.m_ref) { other.m_ref = LUA_REFNIL; }
+    LuaRef(LuaRef &&other) noexcept : LuaRefBase(other.L, other.m_ref) {
+        m_gen = other.m_gen;
+        other.m_ref = LUA_REFNIL;
+    }
 
     LuaRef &operator=(LuaRef &&other) noexcept {
         if (this == &other) return *this;
 
         std::swap(L, other.L);
         std::swap(m_ref, other.m_ref);
+        std::swap(m_gen, other.m_gen);
 
         return *this;
     }
 
     LuaRef &operator=(LuaRef const &other) {
         if (this == &other) return *this;
-        luaL_unref(L, LUA_REGISTRYINDEX, m_ref);
+        detail::UnrefChecked(L, m_ref, m_gen);
         other.Push();
         L = other.L;
-        m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        Ref();
         return *this;
     }
 
     template <typename K>
     LuaRef &operator=(LuaTableElement<K> &&other) noexcept {
-        luaL_unref(L, LUA_REGISTRYINDEX, m_ref);
+        detail::UnrefChecked(L, m_ref, m_gen);
         other.Push();
         L = other.L;
-        m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        Ref();
         return *this;
     }
 
     template <typename K>
     LuaRef &operator=(LuaTableElement<K> const &other) {
-        luaL_unref(L, LUA_REGISTRYINDEX, m_ref);
+        detail::UnrefChecked(L, m_ref, m_gen);
         other.Push();
         L = other.L;
-        m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        Ref();
         return *this;
     }
 
@@ -1055,11 +1295,43 @@ public:
         return LuaRef(L, FromStackIndex());
     }
 
-    static LuaRef NewTable(lua_State *L) {
-        lua_newtable(L);
+    static LuaRef NewTable(lua_State *L, int narr = 0, int nrec = 0) {
+        lua_createtable(L, narr, nrec);
         return LuaRef(L, FromStackIndex());
     }
 
+    // 按 range 大小预分配数组部分后顺序填充
+    template <std::ranges::input_range Range>
+    static LuaRef FromRange(lua_State *L, Range &&range) {
+        int narr = 0;
+        if constexpr (std::ranges::sized_range<Range>) {
+            // 只是预分配的提示 超过 int 范围时截到上限 表随写入继续增长
+            narr = (int)std::min<std::size_t>((std::size_t)std::ranges::size(range), (std::size_t)(std::numeric_limits<int>::max)());
+        }
+        lua_createtable(L, narr, 0);
+        detail::RawSetRange(L, lua_gettop(L), 0, std::forward<Range>(range));
+        return LuaRef(L, FromStackIndex());
+    }
+
+    // 用 range 覆盖数组部分 多余的旧元素置 nil
+    // 当前值不是表时改为引用一个预分配好的新表 (Lua 无法为已有的表预留数组容量)
+    template <std::ranges::input_range Range>
+    LuaRef &Assign(Range &&range) {
+        if (!IsTable()) {
+            return *this = FromRange(L, std::forward<Range>(range));
+        }
+        Push();
+        int t = lua_gettop(L);
+        lua_Integer old = (lua_Integer)lua_rawlen(L, t);
+        lua_Integer n = detail::RawSetRange(L, t, 0, std::forward<Range>(range));
+        for (lua_Integer i = n + 1; i <= old; ++i) {
+            lua_pushnil(L);
+            lua_rawseti(L, t, i);
+        }
+        lua_pop(L, 1);
+        return *this;
+    }
+
     static LuaRef GetGlobal(lua_State *L, char const *name) {
         lua_getglobal(L, name);
         return LuaRef(L, FromStackIndex());
@@ -1112,19 +1384,408 @@ inline LuaRef LuaRefBase::Cast() {
     return LuaRef(L, FromStackIndex());
 }
 
+namespace detail {
+
+// 返回值转换 R 为 void / 单值 / std::tuple 多返回值 定义在 LuaGet 之后
+template <typename R>
+struct LuaResults;
+
+// 对位于 fn 的函数按每组参数调用一次 处理函数只压栈一次
+// 遇到第一个错误即停止 成功的调用在返回前把 LuaResults<R>::count 个结果交给 sink(i)
+template <typename R, typename... Args, typename Sink>
+LuaResult<void> BatchCall(lua_State *L, int fn, std::span<const std::tuple<Args...>> calls, Sink &&sink) {
+    constexpr int results = LuaResults<R>::count;
+    fn = lua_absindex(L, fn);
+    luaL_checkstack(L, (int)sizeof...(Args) + 3, "BatchCall: not enough stack slots");
+    luax_pushmsgh(L);
+    int msgh = lua_gettop(L);
+    for (size_t i = 0; i < calls.size(); ++i) {
+        lua_pushvalue(L, fn);
+        std::apply([L](const Args &...args) { (LuaStack::Push(L, args), ...); }, calls[i]);
+        int status = lua_pcall(L, sizeof...(Args), results, msgh);
+        if (status != LUA_OK) {
+            LuaError err = LuaPopError(L, status);
+            lua_pop(L, 1);
+            return err;
+        }
+        if constexpr (results != 0) {
+            sink(i);
+        }
+    }
+    lua_pop(L, 1);
+    return {};
+}
+
+}  // namespace detail
+
+template <typename Sig>
+class LuaFunction;
+
+// 静态类型的函数句柄 参数与返回值在编译期选定转换 不经过 LuaRef 的动态类型分派
+template <typename R, typename... Args>
+class LuaFunction<R(Args...)> {
+    static constexpr int kResults = detail::LuaResults<R>::count;
+    static constexpr int kStack = (int)sizeof...(Args) + 2;  // 处理函数 + 函数 + 参数
+
+public:
+    LuaFunction() = default;
+
+    // 不是函数时得到无效句柄 (IsValid() 为 false) 调用返回错误 不在构造中途 longjmp
+    LuaFunction(lua_State *L, int index) : L(L) {
+        if (lua_type(L, index) == LUA_TFUNCTION) {
+            lua_pushvalue(L, index);
+            m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+            m_gen = LuaRefGeneration(L);
+        }
+    }
+
+    explicit LuaFunction(const LuaRef &ref) : L(ref.L) {
+        ref.Push();
+        if (lua_type(L, -1) == LUA_TFUNCTION) {
+            m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+            m_gen = LuaRefGeneration(L);
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+
+    explicit LuaFunction(LuaRef &ref) : LuaFunction(static_cast<const LuaRef &>(ref)) {}
+
+    LuaFunction(LuaFunction &&other) noexcept : L(other.L), m_ref(other.m_ref), m_gen(other.m_gen) { other.m_ref = LUA_NOREF; }
+
+    LuaFunction &operator=(LuaFunction &&other) noexcept {
+        std::swap(L, other.L);
+        std::swap(m_ref, other.m_ref);
+        std::swap(m_gen, other.m_gen);
+        return *this;
+    }
+
+    LuaFunction(const LuaFunction &) = delete;
+    LuaFunction &operator=(const LuaFunction &) = delete;
+
+    ~LuaFunction() {
+        if (L) detail::UnrefChecked(L, m_ref, m_gen);
+    }
+
+    static LuaFunction FromGlobal(lua_State *L, const char *name) {
+        lua_getglobal(L, name);
+        LuaFunction f(L, -1);
+        lua_pop(L, 1);
+        return f;
+    }
+
+    bool IsValid() const { return L != nullptr && m_ref != LUA_NOREF && m_ref != LUA_REFNIL; }
+
+    void Push() const { lua_rawgeti(L, LUA_REGISTRYINDEX, m_ref); }
+
+    LuaResult<R> operator()(Args... args) const {
+        if (!IsValid()) {
+            return LuaError{LUA_ERRRUN, "LuaFunction: not a function"};
+        }
+        luaL_checkstack(L, kStack, "LuaFunction: not enough stack slots");
+        Push();
+        (detail::LuaStack::Push(L, args), ...);
+        int status = luax_xpcall(L, sizeof...(Args), kResults);
+        if (status != LUA_OK) {
+            return LuaPopError(L, status);
+        }
+        if constexpr (std::is_void_v<R>) {
+            return {};
+        } else {
+            return detail::LuaResults<R>::Pop(L);
+        }
+    }
+
+    // 对每组参数调用一次 处理函数与函数本身在整个批次中只压栈一次
+    // 遇到第一个错误即停止 之前写入 out 的结果保持有效
+    LuaResult<void> Batch(std::span<const std::tuple<Args...>> calls) const {
+        return BatchImpl(calls, [](size_t) {});
+    }
+
+    template <typename T = R>
+        requires(!std::is_void_v<T>)
+    LuaResult<void> Batch(std::span<const std::tuple<Args...>> calls, std::span<T> out) const {
+        return BatchImpl(calls, [&](size_t i) {
+            if (i < out.size()) {
+                out[i] = detail::LuaResults<R>::Pop(L);
+            } else {
+                lua_pop(L, kResults);
+            }
+        });
+    }
+
+private:
+    template <typename Sink>
+    LuaResult<void> BatchImpl(std::span<const std::tuple<Args...>> calls, Sink &&sink) const {
+        if (!IsValid()) {
+            return LuaError{LUA_ERRRUN, "LuaFunction: not a function"};
+        }
+        luaL_checkstack(L, 1, "LuaFunction: not enough stack slots");
+        Push();
+        LuaResult<void> r = detail::BatchCall<R>(L, -1, calls, std::forward<Sink>(sink));
+        lua_pop(L, 1);
+        return r;
+    }
+
+    lua_State *L = nullptr;
+    int m_ref = LUA_NOREF;
+    u32 m_gen = 0;
+};
+
+namespace detail {
+
+// 每个 VM 一张弱值表 slot -> 对象
+// [0] 为空闲链表头 [-1] 为已分配的最大槽位 空闲槽位中存放下一个空闲槽位
+// 不使用 luaL_ref 因为它按 rawlen 分配 会把值已被回收但仍被持有的槽位再次分配出去
+inline int PushWeakRefTable(lua_State *L) {
+    if (lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "weak_refs") != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 2);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "v");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "weak_refs");
+    }
+    return lua_gettop(L);
+}
+
+// 被 Watch 的槽位集合 (强引用表) 供 WeakLuaRefSweep 检查
+inline int PushWeakWatchTable(lua_State *L) {
+    if (lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "weak_watch") != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "weak_watch");
+    }
+    return lua_gettop(L);
+}
+
+// 弹出栈顶的值并为其分配一个弱引用槽位 nil 返回 0
+inline int WeakRefNew(lua_State *L) {
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    int w = PushWeakRefTable(L);
+    lua_rawgeti(L, w, 0);
+    int slot = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (slot != 0) {
+        lua_rawgeti(L, w, slot);
+        lua_rawseti(L, w, 0);
+    } else {
+        lua_rawgeti(L, w, -1);
+        slot = (int)lua_tointeger(L, -1) + 1;
+        lua_pop(L, 1);
+        lua_pushinteger(L, slot);
+        lua_rawseti(L, w, -1);
+    }
+    lua_pushvalue(L, w - 1);
+    lua_rawseti(L, w, slot);
+    lua_pop(L, 2);
+    return slot;
+}
+
+inline void WeakRefFree(lua_State *L, int slot) {
+    if (slot == 0) return;
+    int w = PushWeakRefTable(L);
+    lua_rawgeti(L, w, 0);
+    lua_rawseti(L, w, slot);
+    lua_pushinteger(L, slot);
+    lua_rawseti(L, w, 0);
+    int s = PushWeakWatchTable(L);
+    lua_pushnil(L);
+    lua_rawseti(L, s, slot);
+    lua_pop(L, 2);
+}
+
+}  // namespace detail
+
+// 不阻止对象被回收的引用 用于 C++ 侧的缓存
+class WeakLuaRef {
+public:
+    WeakLuaRef() = default;
+
+    WeakLuaRef(lua_State *L, int index) : L(L) {
+        lua_pushvalue(L, index);
+        New();
+    }
+
+    explicit WeakLuaRef(const LuaRef &ref) : L(ref.L) {
+        ref.Push();
+        New();
+    }
+
+    // 非 const 左值优先匹配这里 避免实例化 LuaRefBase::operator T<WeakLuaRef>
+    explicit WeakLuaRef(LuaRef &ref) : WeakLuaRef(static_cast<const LuaRef &>(ref)) {}
+
+    WeakLuaRef(const WeakLuaRef &other) : L(other.L) {
+        if (other.PushValue()) {
+            New();
+        }
+    }
+
+    WeakLuaRef(WeakLuaRef &&other) noexcept : L(other.L), m_slot(other.m_slot), m_gen(other.m_gen) { other.m_slot = 0; }
+
+    WeakLuaRef &operator=(WeakLuaRef other) noexcept {
+        std::swap(L, other.L);
+        std::swap(m_slot, other.m_slot);
+        std::swap(m_gen, other.m_gen);
+        return *this;
+    }
+
+    ~WeakLuaRef() {
+        // 弱引用表同样随注册表恢复到重置点
+        if (L && m_slot != 0 && LuaRefGeneration(L) == m_gen) detail::WeakRefFree(L, m_slot);
+    }
+
+    // 对象仍存活时返回强引用
+    std::optional<LuaRef> lock() const {
+        if (!PushValue()) return std::nullopt;
+        std::optional<LuaRef> r(std::in_place, LuaRef::FromStack(L, -1));
+        lua_pop(L, 1);
+        return r;
+    }
+
+    bool expired() const {
+        if (!PushValue()) return true;
+        lua_pop(L, 1);
+        return false;
+    }
+
+    // 槽位号 在本引用析构前唯一 可作为缓存的键
+    int id() const { return m_slot; }
+
+    // 加入检查集合 对象被回收后由 WeakLuaRefSweep 报告一次
+    void Watch() const {
+        if (m_slot == 0) return;
+        int s = detail::PushWeakWatchTable(L);
+        lua_pushboolean(L, 1);
+        lua_rawseti(L, s, m_slot);
+        lua_pop(L, 1);
+    }
+
+private:
+    bool PushValue() const {
+        if (L == nullptr || m_slot == 0) return false;
+        int w = detail::PushWeakRefTable(L);
+        lua_rawgeti(L, w, m_slot);
+        lua_remove(L, w);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            return false;
+        }
+        return true;
+    }
+
+    // 弹出栈顶的值并分配槽位
+    void New() {
+        m_slot = detail::WeakRefNew(L);
+        if (m_slot != 0) m_gen = LuaRefGeneration(L);
+    }
+
+    lua_State *L = nullptr;
+    int m_slot = 0;
+    u32 m_gen = 0;
+};
+
+// 无需 __gc 的失效通知 通常在 GC 步进后调用
+// 对每个已被回收的 Watch 槽位调用一次 fn(id) 返回报告的数量
+template <typename F>
+int WeakLuaRefSweep(lua_State *L, F &&fn) {
+    int s = detail::PushWeakWatchTable(L);
+    int w = detail::PushWeakRefTable(L);
+    int count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, s) != 0) {
+        lua_pop(L, 1);
+        int slot = (int)lua_tointeger(L, -1);
+        if (lua_rawgeti(L, w, slot) == LUA_TNIL) {
+            lua_pushvalue(L, -2);
+            lua_pushnil(L);
+            lua_rawset(L, s);  // 遍历中将已有键置 nil 是允许的
+            fn(slot);
+            ++count;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    return count;
+}
+
+// 绑定函数的特殊返回值 由 Wrap 在离开函数的 C++ 栈帧后处理
+enum {
+    NEKOLUA_BIND_ERROR = -1,  // 错误信息在栈顶 抛出 lua_error
+    NEKOLUA_BIND_YIELD = -2,  // 挂起当前协程 由 LuaAsyncPoll 恢复
+};
+
+// 绑定函数报告错误: 错误信息压栈并返回负值 由 Wrap 在离开函数的 C++ 栈帧后抛出
+// 例: if (!ok) return LuaFail(L, "invalid handle %d", id);
+inline int LuaFail(lua_State *L, const char *fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    luaL_where(L, 1);
+    lua_pushvfstring(L, fmt, argp);
+    va_end(argp);
+    lua_concat(L, 2);
+    return NEKOLUA_BIND_ERROR;
+}
+
+namespace detail {
+
+// 异步挂起时 yield 出的唯一值 (lightuserdata) Lua 侧调度器可据此识别
+inline const char async_yield_tag = 0;
+
+// LuaAsyncPoll 正在恢复的协程与压入的恢复值个数 其他来源的 resume 被忽略
+inline thread_local lua_State *async_resuming = nullptr;
+inline thread_local int async_resume_nargs = 0;
+
+}  // namespace detail
+
+// 异步函数恢复后的延续 ctx 为挂起时的栈顶 恢复值是 (true, 结果...) 或 (false, 错误信息)
+inline int LuaAsyncContinue(lua_State *L, int, lua_KContext ctx) {
+    int base = (int)ctx;
+    if (detail::async_resuming != L) {
+        // 不是 LuaAsyncPoll 的恢复 (例如 Lua 侧调度器的 coroutine.resume) 丢弃参数继续挂起
+        lua_settop(L, base);
+        lua_pushlightuserdata(L, (void *)&detail::async_yield_tag);
+        return lua_yieldk(L, 1, ctx, LuaAsyncContinue);
+    }
+    detail::async_resuming = nullptr;
+    int first = lua_gettop(L) - detail::async_resume_nargs + 1;
+    for (; first > base + 1; --first) {
+        lua_remove(L, base + 1);  // 恢复方未取走的旧 yield 值
+    }
+    if (!lua_toboolean(L, base + 1)) {
+        return lua_error(L);
+    }
+    return lua_gettop(L) - base - 1;
+}
+
 template <lua_CFunction func>
 int Wrap(lua_State *L) {
+#if NEKO_LUA_EXCEPTIONS
     int result = 0;
     try {
         result = func(L);
     }
-    // 将带有描述的异常转换为 lua_error
+    // 将带有描述的异常转换为 lua_error 在 catch 块之外抛出
+    // 其他异常 (例如以 C++ 编译的 Lua 的 lua_error) 原样传播
     catch (std::exception &e) {
-        luaL_error(L, e.what());
+        result = LuaFail(L, "%s", e.what());
     }
-    // 重新抛出任何其他异常 (例如lua_error)
-    catch (...) {
-        throw;
+#else
+    int result = func(L);
+#endif
+    if (result == NEKOLUA_BIND_YIELD) {
+        int base = lua_gettop(L);
+        lua_pushlightuserdata(L, (void *)&detail::async_yield_tag);
+        return lua_yieldk(L, 1, (lua_KContext)base, LuaAsyncContinue);
+    }
+    if (result < 0) {
+        return lua_error(L);
     }
     return result;
 }
@@ -1297,1216 +1958,4346 @@ static inline int l_nameof(lua_State *L) {
     return 2;
 }
 
-struct LuaVM {
+// 异步完成队列 工作线程只向这里追加 由 VM 所在线程在 LuaAsyncPoll 中取出
+struct LuaAsyncQueue {
+    struct Completion {
+        int thread_ref;                        // 挂起的协程
+        std::function<int(lua_State *)> push;  // 在协程栈上压入恢复值 返回个数
+    };
 
-    struct Tools {
+    std::mutex mutex;
+    std::vector<Completion> done;
 
-        static void check_arg_count(lua_State *L, int expected) {
-            int n = lua_gettop(L);
-            if (n != expected) {
-                luaL_error(L, "Got %d arguments, expected %d", n, expected);
-                return;
-            }
-            return;
-        };
+    void Push(Completion c) {
+        std::lock_guard lock(mutex);
+        done.push_back(std::move(c));
+    }
+};
 
-        template <typename T>
-        static void ForEachTable(lua_State *L, T f, int index, int indent = 0) {
-            lua_pushnil(L);
-            while (lua_next(L, index) != 0) {
-                // for (int i = 0; i < indent; i++) f(" ");
-                if (lua_type(L, -2) == LUA_TSTRING) {
-                    f(index, lua_tostring(L, -2));
-                } else if (lua_type(L, -2) == LUA_TNUMBER) {
-                    f(index, lua_tonumber(L, -2));
-                } else {
-                    f(index, lua_typename(L, lua_type(L, -2)));
-                }
+struct LuaAsyncPollResult {
+    int resumed = 0;
+    std::vector<LuaError> errors;  // 恢复后协程中的错误 (带 traceback) 或无人接收的 yield
+};
 
-                if (lua_type(L, -1) == LUA_TSTRING) {
-                    f(index, lua_tostring(L, -1));
-                } else if (lua_type(L, -1) == LUA_TNUMBER) {
-                    f(index, lua_tonumber(L, -1));
-                } else if (lua_type(L, -1) == LUA_TTABLE) {
-                    f(index, "table");
-                    ForEachTable(L, f, lua_gettop(L), indent + 1);
-                } else {
-                    f(index, lua_typename(L, lua_type(L, -1)));
-                }
-                lua_pop(L, 1);
-            }
-        }
+// 事件队列的类型擦除接口 由 LuaEventQueue<E> 实现
+struct LuaEventQueueBase {
+    virtual ~LuaEventQueueBase() = default;
+    virtual size_t Size() const = 0;
+    // 将前 n 个事件写入 t[1..n] used 为表中已占用的元素个数 返回写入后占用的个数
+    virtual size_t Fill(lua_State *L, int t, size_t n, size_t used) = 0;
+    // 移除已分发的前 n 个事件 分发期间新加入的事件保留到下次
+    virtual void Consume(size_t n) = 0;
 
-        template <typename T>
-        static void ForEachStack(lua_State *L, T f) {
-            int top = lua_gettop(L);
-            for (int i = 1; i <= top; i++) {
-                int t = lua_type(L, i);
-                switch (t) {
-                    case LUA_TSTRING:
-                        f(i, lua_tostring(L, i));
-                        break;
-                    case LUA_TBOOLEAN:
-                        f(i, lua_toboolean(L, i) ? "true" : "false");
-                        break;
-                    case LUA_TNUMBER:
-                        f(i, lua_tonumber(L, i));
-                        break;
-                    case LUA_TTABLE:
-                        f(i, "table:");
-                        ForEachTable(L, f, i);
-                        break;
-                    default:
-                        f(i, lua_typename(L, t));
-                        break;
-                }
-            }
-        }
-    };
+    const void *type = nullptr;
+};
 
-    static void *Allocf(void *ud, void *ptr, size_t osize, size_t nsize) {
-        static size_t lua_mem_usage;
-        if (!ptr) osize = 0;
-        if (!nsize) {
-            lua_mem_usage -= osize;
-            free(ptr);
-            return NULL;
-        }
-        lua_mem_usage += (nsize - osize);
-        return realloc(ptr, nsize);
-    }
+// LuaVM::GCStep 驱动的回收统计 只计入显式步进所用的时间
+struct LuaGCStats {
+    u64 cycles = 0;
+    double last_cycle_us = 0;   // 上一个完整周期的步进耗时
+    size_t last_collected = 0;  // 上一个周期回收的字节数
+    double cycle_us = 0;        // 当前周期已用的步进耗时
+    u64 cycle_mark = 0;         // 当前周期开始时的 freed_bytes 或 (无统计时) 内存用量
+    bool started = false;       // 首次 GCStep 时取基线 之前的释放不计入第一个周期
+};
 
-    lua_State *L;
+// LuaVM 设置的回收模式与参数 0 表示使用 Lua 的默认值
+// 两种模式的参数分别保存 只在切换到对应模式时生效 设置参数不会改变当前模式
+struct LuaGCConfig {
+    bool generational = false;
+    bool manual = false;
+    int pause = 0;
+    int stepmul = 0;
+    int minormul = 0;
+    int majormul = 0;
+};
 
-    LuaVM() = default;
-    LuaVM(lua_State *l) : L(l) {}
+// 每个 VM 一份的 C++ 侧数据 以完整 userdata 存放在注册表中 随 lua_close 析构
+struct LuaVMData {
+    // LuaGlobalFunction 句柄的失效版本号
+    u64 globals_version = 1;
 
-    inline lua_State *Create() {
+    // 每次 LuaReset 加一 见 LuaRefGeneration
+    u32 ref_generation = 0;
 
-#ifdef _DEBUG
-        lua_State *L = ::lua_newstate(Allocf, NULL);
-#else
-        lua_State *L = ::luaL_newstate();
-#endif
+    // 重置点保存的内存上限与回收设置 LuaReset 时重新应用
+    size_t reset_mem_limit = 0;
+    LuaGCConfig reset_gc_config;
 
-        ::luaL_openlibs(L);
+    // 事件订阅者按 priority 降序 同优先级按订阅顺序
+    struct EventSubscriber {
+        int ref = LUA_NOREF;
+        int priority = 0;
+        u32 id = 0;
+    };
 
-#ifdef NEKO_CFFI
-        lua_gc(L, LUA_GCSETPAUSE, 150);
-#endif
+    struct EventChannel {
+        std::vector<EventSubscriber> subs;
+        std::vector<EventSubscriber> pending;  // 分发期间新增的订阅
+        std::unique_ptr<LuaEventQueueBase> queue;
+        int batch_ref = LUA_NOREF;  // 复用的批次表
+        size_t batch_used = 0;
+        bool flushing = false;
+        bool dirty = false;  // 分发期间有退订 结束后压缩
+    };
 
-        lua_pushinteger(L, 0);
-        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_index");
-        lua_newtable(L);
-        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_ids");
-        lua_newtable(L);
-        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_names");
-        lua_newtable(L);
-        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_sizes");
+    // 按 C++ 类型缓存的类型 id 与枚举名表 下标来自 LuaTypeSlot<T>()
+    struct TypeCache {
+        lua_Integer id = 0;
+        int enum_names = LUA_NOREF;  // 枚举值 -> 名字
+    };
 
-        lua_newtable(L);
-        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "stack_push");
-        lua_newtable(L);
-        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "stack_to");
+    std::vector<TypeCache> types;
+
+    // 以 shared_ptr 持有 VM 关闭后迟到的完成回调仍可安全写入
+    std::shared_ptr<LuaAsyncQueue> async = std::make_shared<LuaAsyncQueue>();
+    size_t async_pending = 0;
+
+    // 已运行结束可复用的协程 (注册表引用) 由 LuaTask 借出与归还
+    std::vector<int> thread_pool;
+    size_t thread_pool_max = 256;
+
+    LuaGCStats gc;
+    LuaGCConfig gc_config;
+
+    // 正在执行的 LuaCall(..., LuaBudget) 的预算状态 嵌套调用由调用方保存与恢复
+    struct Budget {
+        bool active = false;
+        bool exceeded = false;
+        int interval = 0;  // 钩子每隔多少条指令触发
+        u64 executed = 0;
+        u64 max_instructions = 0;
+        bool timed = false;
+        int time_every = 0;
+        int ticks = 0;
+        std::chrono::steady_clock::time_point deadline{};
+    };
 
-        lua_newtable(L);
-        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
-        lua_newtable(L);
-        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
-        lua_newtable(L);
-        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_values");
+    Budget budget;
 
-        lua_newtable(L);
-        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs");
-        lua_newtable(L);
-        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_sizes");
-        lua_newtable(L);
-        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_fields");
+    // 已编译代码块的 LRU 缓存 键为 chunkname 与源码的 fnv1a 命中时再逐字节比较源码
+    struct Chunk {
+        u64 key = 0;
+        int ref = LUA_NOREF;
+        std::string name;
+        std::string src;
+    };
 
-        luaL_Reg builtin_funcs[] = {
-                {"nameof", Wrap<l_nameof>},
-        };
+    std::list<Chunk> chunks;  // 最近使用的在前
+    std::unordered_map<u64, std::list<Chunk>::iterator> chunk_index;
+    size_t chunk_cache_max = 128;
+    bool chunk_cache_run_string = false;  // RunString 是否经过缓存 默认关闭
+    std::string chunk_cache_dir;          // 非空时把 lua_dump 的结果缓存到此目录
 
-        for (auto f : builtin_funcs) {
-            lua_register(L, f.name, f.func);
-        }
+    std::unordered_map<std::string, EventChannel> events;
+    std::vector<EventChannel *> event_order;  // 元素地址稳定 按创建顺序分发
+    u32 event_next_id = 1;
 
-        this->L = L;
+    EventChannel &Channel(const char *name) {
+        auto [it, inserted] = events.try_emplace(name);
+        if (inserted) {
+            event_order.push_back(&it->second);
+        }
+        return it->second;
+    }
 
-        return L;
+    // 注册表恢复到重置点后 丢弃所有指向已失效引用的运行时状态
+    // 事件通道本身保留 (C++ 侧可能持有队列) 只清空订阅与排队的事件
+    void ResetRuntime() {
+        ++globals_version;
+        ++ref_generation;
+        chunks.clear();
+        chunk_index.clear();
+        types.clear();
+        thread_pool.clear();
+        async = std::make_shared<LuaAsyncQueue>();
+        async_pending = 0;
+        for (EventChannel *ch : event_order) {
+            ch->subs.clear();
+            ch->pending.clear();
+            ch->batch_ref = LUA_NOREF;
+            ch->batch_used = 0;
+            ch->dirty = false;
+            if (ch->queue) ch->queue->Consume(ch->queue->Size());
+        }
     }
+};
 
-    inline void Fini(lua_State *L) {
-        if (L) {
+template <>
+struct udata<LuaVMData> {
+    static void metatable(lua_State *) {}
+};
 
-            lua_pushnil(L);
-            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_index");
-            lua_pushnil(L);
-            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_ids");
-            lua_pushnil(L);
-            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_names");
-            lua_pushnil(L);
-            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_sizes");
+inline LuaVMData &GetLuaVMData(lua_State *L) {
+    static const int key = 0;
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &key) == LUA_TUSERDATA) {
+        LuaVMData *data = toudata_ptr<LuaVMData>(L, -1);
+        lua_pop(L, 1);
+        return *data;
+    }
+    lua_pop(L, 1);
+    LuaVMData &data = newudata<LuaVMData>(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &key);
+    return data;
+}
 
-            lua_pushnil(L);
-            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "stack_push");
-            lua_pushnil(L);
-            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "stack_to");
+inline u32 LuaRefGeneration(lua_State *L) { return GetLuaVMData(L).ref_generation; }
 
-            lua_pushnil(L);
-            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
-            lua_pushnil(L);
-            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
-            lua_pushnil(L);
-            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_values");
+inline size_t LuaNextTypeSlot() {
+    static std::atomic<size_t> next{0};
+    return next++;
+}
 
-            lua_pushnil(L);
-            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs");
-            lua_pushnil(L);
-            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_sizes");
-            lua_pushnil(L);
-            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_fields");
+// 每个 C++ 类型一个进程内唯一的下标
+template <typename T>
+size_t LuaTypeSlot() {
+    static const size_t slot = LuaNextTypeSlot();
+    return slot;
+}
 
-            int top = lua_gettop(L);
-            if (top != 0) {
-                Tools::ForEachStack(L, []<typename T>(int i, T v) -> int {
-                    std::cout << i << ':' << v << std::endl;
-                    return 0;
-                });
-                printf("luastack memory leak\n");
-            }
-            ::lua_close(L);
-        }
+template <typename T>
+LuaVMData::TypeCache &LuaTypeCacheEntry(lua_State *L) {
+    auto &types = GetLuaVMData(L).types;
+    size_t slot = LuaTypeSlot<T>();
+    if (slot >= types.size()) {
+        types.resize(slot + 1);
     }
+    return types[slot];
+}
 
-    // template <typename T>
-    operator lua_State *() { return L; }
-
-    inline void operator()(const std::string &func) const {
-        lua_getglobal(L, func.c_str());
-
-        if (lua_pcall(L, 0, 0, 0) != 0) {
-            std::string err = lua_tostring(L, -1);
-            ::lua_pop(L, 1);
-            printf("%s", err.c_str());
-        }
-    }
+// 使所有 LuaGlobalFunction 句柄失效 在 Lua 侧重新赋值已有全局函数后调用
+inline void LuaGlobalsChanged(lua_State *L) { ++GetLuaVMData(L).globals_version; }
 
-    inline void RunString(const std::string &str) {
-        if (luaL_dostring(L, str.c_str())) {
-            std::string err = lua_tostring(L, -1);
-            ::lua_pop(L, 1);
-            printf("%s", err.c_str());
-        }
+// 为 _G 安装 __newindex 监视 新增全局变量时自动失效缓存
+// 对已存在键的重新赋值 Lua 不会触发 __newindex 仍需调用 LuaGlobalsChanged
+inline bool LuaWatchGlobals(lua_State *L) {
+    lua_pushglobaltable(L);
+    if (lua_getmetatable(L, -1)) {
+        lua_pop(L, 2);
+        return false;  // 不覆盖已有的 _G 元表
     }
-};
-
-inline void DumpLuaRef(const LuaRef &ref) {
-    ref.Push();  // 把 LuaRef 存的值推到 Lua 栈顶
-    LuaVM::Tools::ForEachStack(ref.L, []<typename T>(int i, T v) -> int {
-        std::cout << i << ':' << v << std::endl;
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, [](lua_State *L) -> int {
+        LuaGlobalsChanged(L);
+        lua_settop(L, 3);
+        lua_rawset(L, 1);
         return 0;
     });
-    lua_pop(ref.L, 1);  // 清理 Lua 栈
+    lua_setfield(L, -2, "__newindex");
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
+    return true;
 }
 
-namespace LuaValue {
-template <class>
-inline constexpr bool always_false_v = false;
+// 压入全局函数 name 不是函数时返回 false 且不压栈
+inline bool PushGlobalFunction(lua_State *L, const char *name) {
+    if (lua_getglobal(L, name) != LUA_TFUNCTION) {
+        lua_pop(L, 1);
+        return false;
+    }
+    return true;
+}
 
-using Value = std::variant<std::monostate,  // LUA_TNIL
-                           bool,            // LUA_TBOOLEAN
-                           void *,          // LUA_TLIGHTUSERDATA
-                           lua_Integer,     // LUA_TNUMBER
-                           lua_Number,      // LUA_TNUMBER
-                           std::string,     // LUA_TSTRING
-                           lua_CFunction    // LUA_TFUNCTION
-                           >;
-using Table = std::map<std::string, Value>;
+// 显式启用的全局函数缓存 版本号未变时只做一次 lua_rawgeti
+// 版本号只由 RunString LuaGlobalsChanged 与 LuaWatchGlobals (仅新增的键) 推进
+// 在回调或其他调用中重新赋值已有全局函数后 句柄仍指向旧函数 需要调用 LuaGlobalsChanged
+class LuaGlobalFunction {
+public:
+    LuaGlobalFunction(lua_State *L, std::string name) : L(L), m_name(std::move(name)) {}
 
-inline void Set(lua_State *L, int idx, Value &v) {
-    switch (lua_type(L, idx)) {
-        case LUA_TNIL:
-            v.emplace<std::monostate>();
-            break;
-        case LUA_TBOOLEAN:
-            v.emplace<bool>(!!lua_toboolean(L, idx));
-            break;
-        case LUA_TLIGHTUSERDATA:
-            v.emplace<void *>(lua_touserdata(L, idx));
-            break;
-        case LUA_TNUMBER:
-            if (lua_isinteger(L, idx)) {
-                v.emplace<lua_Integer>(lua_tointeger(L, idx));
+    LuaGlobalFunction(LuaGlobalFunction &&other) noexcept : L(other.L), m_name(std::move(other.m_name)), m_ref(other.m_ref), m_gen(other.m_gen), m_version(other.m_version) {
+        other.m_ref = LUA_NOREF;
+    }
+    LuaGlobalFunction(const LuaGlobalFunction &) = delete;
+    LuaGlobalFunction &operator=(const LuaGlobalFunction &) = delete;
+
+    ~LuaGlobalFunction() {
+        if (L) detail::UnrefChecked(L, m_ref, m_gen);
+    }
+
+    lua_State *State() const { return L; }
+    const std::string &Name() const { return m_name; }
+
+    // 不是函数时返回 false 且不压栈
+    bool Push() {
+        LuaVMData &vm = GetLuaVMData(L);
+        if (m_version != vm.globals_version) {
+            if (m_gen == vm.ref_generation) luaL_unref(L, LUA_REGISTRYINDEX, m_ref);
+            m_ref = LUA_NOREF;
+            m_version = vm.globals_version;
+            if (lua_getglobal(L, m_name.c_str()) == LUA_TFUNCTION) {
+                m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+                m_gen = vm.ref_generation;
             } else {
-                v.emplace<lua_Number>(lua_tonumber(L, idx));
+                lua_pop(L, 1);
             }
-            break;
-        case LUA_TSTRING: {
-            size_t sz = 0;
-            const char *str = lua_tolstring(L, idx, &sz);
-            v.emplace<std::string>(str, sz);
-            break;
         }
-        case LUA_TFUNCTION: {
-            lua_CFunction func = lua_tocfunction(L, idx);
-            if (func == NULL || lua_getupvalue(L, idx, 1) != NULL) {
-                luaL_error(L, "Only light C function can be serialized");
-                return;
-            }
-            v.emplace<lua_CFunction>(func);
-            break;
+        if (m_ref == LUA_NOREF) {
+            return false;
         }
-        default:
-            luaL_error(L, "Unsupport type %s to serialize", lua_typename(L, idx));
+        lua_rawgeti(L, LUA_REGISTRYINDEX, m_ref);
+        return true;
+    }
+
+private:
+    lua_State *L = nullptr;
+    std::string m_name;
+    int m_ref = LUA_NOREF;
+    u32 m_gen = 0;
+    u64 m_version = 0;
+};
+
+// 单次调用的执行预算 指令数按钩子间隔计 精度为 hook_interval
+// 时间每 time_every 次钩子 (即 hook_interval * time_every 条指令) 检查一次
+struct LuaBudget {
+    u64 instructions = 0;  // 0 表示不限制
+    double time_ms = 0;    // 0 表示不限制
+    int hook_interval = 1000;
+    int time_every = 10;
+};
+
+inline void LuaBudgetHook(lua_State *L, lua_Debug *) {
+    LuaVMData::Budget &b = GetLuaVMData(L).budget;
+    if (!b.active) {
+        lua_sethook(L, nullptr, 0, 0);  // 预算调用中创建的协程继承了钩子 调用结束后移除
+        return;
+    }
+    const char *reason = nullptr;
+    b.executed += (u64)b.interval;
+    if (b.exceeded) {
+        reason = "budget exceeded";
+    } else if (b.max_instructions != 0 && b.executed >= b.max_instructions) {
+        reason = "instruction budget exceeded";
+    } else if (b.timed && ++b.ticks >= b.time_every) {
+        b.ticks = 0;
+        if (std::chrono::steady_clock::now() >= b.deadline) reason = "time budget exceeded";
+    }
+    if (reason != nullptr) {
+        // 之后每条指令都触发钩子 被 pcall 捕获后回到外层的第一条指令再次报错
+        b.exceeded = true;
+        b.interval = 1;
+        lua_sethook(L, LuaBudgetHook, LUA_MASKCOUNT, 1);
+        luaL_error(L, "%s", reason);
     }
 }
 
-inline void Set(lua_State *L, int idx, Table &t) {
-    luaL_checktype(L, idx, LUA_TTABLE);
-    lua_pushnil(L);
-    while (lua_next(L, idx)) {
-        size_t sz = 0;
-        const char *str = luaL_checklstring(L, -2, &sz);
-        std::pair<std::string, Value> pair;
-        pair.first.assign(str, sz);
-        Set(L, -1, pair.second);
-        t.emplace(pair);
-        lua_pop(L, 1);
+namespace detail {
+
+// 预算期间被恢复的协程 (包括预算外创建的与 LuaTask 池中的) 临时装上预算钩子 恢复结束后还原
+struct BudgetResumeHook {
+    lua_State *co;
+    lua_Hook hook;
+    int mask, count;
+    bool installed = false;
+
+    BudgetResumeHook(lua_State *L, lua_State *co) : co(co) {
+        const LuaVMData::Budget &b = GetLuaVMData(L).budget;
+        if (!b.active || co == nullptr) return;
+        hook = lua_gethook(co);
+        mask = lua_gethookmask(co);
+        count = lua_gethookcount(co);
+        lua_sethook(co, LuaBudgetHook, LUA_MASKCOUNT, b.interval);
+        installed = true;
     }
-}
+    ~BudgetResumeHook() { Restore(); }
+    void Restore() {
+        if (installed) lua_sethook(co, hook, mask, count);
+        installed = false;
+    }
+};
 
-inline void Get(lua_State *L, const Value &v) {
-    std::visit(
-            [=](auto &&arg) {
-                using T = std::decay_t<decltype(arg)>;
-                if constexpr (std::is_same_v<T, std::monostate>) {
-                    lua_pushnil(L);
-                } else if constexpr (std::is_same_v<T, bool>) {
-                    lua_pushboolean(L, arg);
-                } else if constexpr (std::is_same_v<T, void *>) {
-                    lua_pushlightuserdata(L, arg);
-                } else if constexpr (std::is_same_v<T, lua_Integer>) {
-                    lua_pushinteger(L, arg);
-                } else if constexpr (std::is_same_v<T, lua_Number>) {
-                    lua_pushnumber(L, arg);
-                } else if constexpr (std::is_same_v<T, std::string>) {
-                    lua_pushlstring(L, arg.data(), arg.size());
-                } else if constexpr (std::is_same_v<T, lua_CFunction>) {
-                    lua_pushcfunction(L, arg);
-                } else {
-                    static_assert(always_false_v<T>, "non-exhaustive visitor!");
-                }
-            },
-            v);
+// coroutine.resume 的替身 upvalue 1 为原函数
+// 参数检查在装钩子之前 原函数不会再抛错 析构一定执行
+inline int BudgetCoResume(lua_State *L) {
+    lua_State *co = lua_tothread(L, 1);
+    luaL_checktype(L, 1, LUA_TTHREAD);
+    BudgetResumeHook scope(L, co);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    scope.Restore();
+    return lua_gettop(L);
 }
 
-inline void Get(lua_State *L, const Table &t) {
-    lua_createtable(L, 0, static_cast<int>(t.size()));
-    for (const auto &[k, v] : t) {
-        lua_pushlstring(L, k.data(), k.size());
-        Get(L, v);
-        lua_rawset(L, -3);
+// coroutine.wrap 返回的函数 upvalue 1 为协程 upvalue 2 为 BudgetCoResume 闭包
+inline int BudgetCoWrapCall(lua_State *L) {
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    if (lua_toboolean(L, 1)) {
+        return lua_gettop(L) - 1;
+    }
+    // 与原版 wrap 一致 出错的协程先关闭 (执行待关闭变量) 字符串错误补上调用位置后继续抛出
+    int status = LUA_ERRRUN;
+    lua_State *co = lua_tothread(L, lua_upvalueindex(1));
+    if (lua_status(co) != LUA_OK && lua_status(co) != LUA_YIELD) {
+#if defined(LUA_VERSION_RELEASE_NUM) && LUA_VERSION_RELEASE_NUM >= 50406
+        status = lua_closethread(co, L);
+        lua_xmove(co, L, 1);  // 关闭时 __close 可能替换了错误对象
+#elif defined(LUA_VERSION_RELEASE_NUM) && LUA_VERSION_RELEASE_NUM >= 50404
+        status = lua_resetthread(co);
+        lua_xmove(co, L, 1);
+#endif
+    }
+    if (status != LUA_ERRMEM && lua_type(L, -1) == LUA_TSTRING) {
+        luaL_where(L, 1);
+        lua_insert(L, -2);
+        lua_concat(L, 2);
     }
+    return lua_error(L);
 }
 
-}  // namespace LuaValue
+inline int BudgetCoWrap(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_State *co = lua_newthread(L);
+    lua_pushvalue(L, 1);
+    lua_xmove(L, co, 1);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushcclosure(L, BudgetCoWrapCall, 2);
+    return 1;
+}
 
-int vfs_lua_loader(lua_State *L);
+// 替换 coroutine 库的 resume 与 wrap 已替换过则跳过
+// 在 LuaVM::Create 中安装 脚本事先缓存的 local resume = coroutine.resume 也受预算约束
+inline void InstallBudgetResume(lua_State *L) {
+    luax_pushloadedtable(L);
+    lua_getfield(L, -1, LUA_COLIBNAME);
+    lua_remove(L, -2);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_getfield(L, -1, "resume");
+    if (!lua_isfunction(L, -1) || lua_tocfunction(L, -1) == BudgetCoResume) {
+        lua_pop(L, 2);
+        return;
+    }
+    lua_pushcclosure(L, BudgetCoResume, 1);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, "resume");
+    lua_pushcclosure(L, BudgetCoWrap, 1);
+    lua_setfield(L, -2, "wrap");
+    lua_pop(L, 1);
+}
 
-struct LUASTRUCT_CDATA {
-    int ref;
-    size_t cdata_size;
-    const_str type_name;
-};
+}  // namespace detail
 
-static inline void LuaStructSetMetatable(lua_State *L, const char *metatable, int index) {
-    luaL_getmetatable(L, metatable);
-    if (lua_isnoneornil(L, -1)) luaL_error(L, "The metatable for %s has not been defined", metatable);
-    lua_setmetatable(L, index - 1);
+// 在预算内调用栈顶函数 超出预算时以错误中止 脚本中的 pcall 无法吞掉 (之后每次钩子都会再次报错)
+// 嵌套调用取内外两层预算中更严格的一个 预算期间临时替换当前线程已有的钩子
+inline LuaResult<void> LuaCall(lua_State *L, int nargs, int nresults, const LuaBudget &budget) {
+    LuaVMData &vm = GetLuaVMData(L);
+    LuaVMData::Budget outer = vm.budget;
+    LuaVMData::Budget &b = vm.budget;
+    b = {};
+    b.active = true;
+    b.interval = budget.hook_interval > 0 ? budget.hook_interval : 1000;
+    b.max_instructions = budget.instructions;
+    if (outer.active && outer.max_instructions != 0) {
+        u64 left = outer.max_instructions > outer.executed ? outer.max_instructions - outer.executed : 1;
+        if (b.max_instructions == 0 || left < b.max_instructions) b.max_instructions = left;
+    }
+    if (b.max_instructions != 0 && b.max_instructions < (u64)b.interval) {
+        b.interval = (int)b.max_instructions;
+    }
+    if (budget.time_ms > 0) {
+        b.timed = true;
+        b.time_every = budget.time_every > 0 ? budget.time_every : 1;
+        b.deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(budget.time_ms));
+    }
+    if (outer.active && outer.timed && (!b.timed || outer.deadline < b.deadline)) {
+        b.timed = true;
+        b.time_every = outer.time_every;
+        b.deadline = outer.deadline;
+    }
+
+    detail::InstallBudgetResume(L);
+    lua_Hook hook = lua_gethook(L);
+    int mask = lua_gethookmask(L), count = lua_gethookcount(L);
+    lua_sethook(L, LuaBudgetHook, LUA_MASKCOUNT, b.interval);
+    int status = luax_xpcall(L, nargs, nresults);
+    lua_sethook(L, hook, mask, count);
+
+    outer.executed += b.executed;
+    b = outer;
+    if (status != LUA_OK) {
+        return LuaPopError(L, status);
+    }
+    return {};
 }
 
-inline int LuaStructNew(lua_State *L, const char *metatable, size_t size) {
-    LUASTRUCT_CDATA *reference = (LUASTRUCT_CDATA *)lua_newuserdata(L, sizeof(LUASTRUCT_CDATA) + size);
-    std::memset(reference, 0, sizeof(LUASTRUCT_CDATA) + size);
-    reference->ref = LUA_NOREF;
-    reference->cdata_size = size;
-    reference->type_name = metatable;
-    void *data = (void *)(reference + 1);
-    memset(data, 0, size);
-    LuaStructSetMetatable(L, metatable, -1);
-    return 1;
+namespace detail {
+
+inline int DumpWriter(lua_State *, const void *p, size_t sz, void *ud) {
+    static_cast<std::string *>(ud)->append(static_cast<const char *>(p), sz);
+    return 0;
 }
 
-// ParentIndex 是包含对象的堆栈索引 或者 0 表示不包含对象
-inline int LuaStructNewRef(lua_State *L, const char *metatable, int parentIndex, const void *data) {
-    LUASTRUCT_CDATA *reference = (LUASTRUCT_CDATA *)lua_newuserdata(L, sizeof(LUASTRUCT_CDATA) + sizeof(data));
+inline bool ReadFile(const std::string &path, std::string &out) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == nullptr) return false;
+    char buf[4096];
+    size_t n = 0;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) out.append(buf, n);
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
 
-    if (parentIndex != 0) {
-        // 存储对包含对象的引用
-        lua_pushvalue(L, parentIndex);
-        reference->ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    } else {
-        reference->ref = LUA_REFNIL;
+// 先写临时文件再改名 并发的进程不会读到写了一半的字节码
+// 临时文件名带随机后缀 多个进程/线程同时写同一文件时互不覆盖
+inline bool WriteFile(const std::string &path, const std::string &data) {
+    static std::atomic<u32> counter{0};
+    char suffix[48];
+    snprintf(suffix, sizeof(suffix), ".%08x%08x.tmp", (unsigned)std::random_device{}(), (unsigned)counter.fetch_add(1));
+    std::string tmp = path + suffix;
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (f == nullptr) return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = fclose(f) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        return false;
     }
+    return true;
+}
 
-    *((const void **)(reference + 1)) = data;
+}  // namespace detail
 
-    LuaStructSetMetatable(L, metatable, -1);
+// 栈顶 Lua 函数的字节码 保留调试信息 (行号与局部变量名)
+inline std::string LuaDump(lua_State *L) {
+    std::string out;
+#if LUA_VERSION_NUM >= 503
+    lua_dump(L, detail::DumpWriter, &out, 0);
+#else
+    lua_dump(L, detail::DumpWriter, &out);
+#endif
+    return out;
+}
 
-    return 1;
+namespace detail {
+
+inline u64 ChunkKey(std::string_view name, std::string_view src) { return fnv1a(src.data(), src.size()) ^ (fnv1a(name.data(), name.size()) * 1099511628211u); }
+
+// 命中时移到 LRU 头部并压入函数 哈希相同但源码或名字不同视为未命中
+inline bool ChunkCacheGet(lua_State *L, LuaVMData &vm, u64 key, std::string_view name, std::string_view src) {
+    auto it = vm.chunk_index.find(key);
+    if (it == vm.chunk_index.end() || it->second->src != src || it->second->name != name) {
+        return false;
+    }
+    vm.chunks.splice(vm.chunks.begin(), vm.chunks, it->second);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, it->second->ref);
+    return true;
 }
 
-inline int LuaStructGC(lua_State *L, const char *metatable) {
-    LUASTRUCT_CDATA *reference = (LUASTRUCT_CDATA *)luaL_checkudata(L, 1, metatable);
-    // printf("LuaStructGC %s %d %p\n", metatable, reference->ref, reference);
-    luaL_unref(L, LUA_REGISTRYINDEX, reference->ref);
-    return 0;
+// 记录栈顶的函数 (不弹出) 超出 chunk_cache_max 时淘汰最久未用的
+inline void ChunkCachePut(lua_State *L, LuaVMData &vm, u64 key, std::string_view name, std::string_view src) {
+    if (vm.chunk_cache_max == 0) return;
+    if (auto it = vm.chunk_index.find(key); it != vm.chunk_index.end()) {
+        luaL_unref(L, LUA_REGISTRYINDEX, it->second->ref);
+        vm.chunks.erase(it->second);
+        vm.chunk_index.erase(it);
+    }
+    lua_pushvalue(L, -1);
+    vm.chunks.push_front({key, luaL_ref(L, LUA_REGISTRYINDEX), std::string(name), std::string(src)});
+    vm.chunk_index[key] = vm.chunks.begin();
+    while (vm.chunks.size() > vm.chunk_cache_max) {
+        LuaVMData::Chunk &old = vm.chunks.back();
+        luaL_unref(L, LUA_REGISTRYINDEX, old.ref);
+        vm.chunk_index.erase(old.key);
+        vm.chunks.pop_back();
+    }
 }
 
-inline int LuaStructIs(lua_State *L, const char *metatable, int index) {
-    if (lua_type(L, index) != LUA_TUSERDATA) {
-        return 0;
+}  // namespace detail
+
+// 编译 src 并压入得到的函数 同一 VM 中相同 chunkname 与源码的代码块只解析一次
+// 设置了 chunk_cache_dir 时先尝试目录中以 Lua 版本与哈希命名的 .luac 未命中则编译后写入
+// 该目录中的字节码不经校验直接加载 只能指向可信的位置
+// 失败时压入错误信息并返回 lua_load 的状态
+inline int LuaLoadCached(lua_State *L, std::string_view src, const char *chunkname = nullptr) {
+    LuaVMData &vm = GetLuaVMData(L);
+    std::string name = chunkname ? chunkname : std::string(src.substr(0, 60));
+    u64 key = detail::ChunkKey(name, src);
+    if (detail::ChunkCacheGet(L, vm, key, name, src)) {
+        return LUA_OK;
     }
-    lua_getmetatable(L, index);
-    luaL_getmetatable(L, metatable);
-    int metatablesMatch = lua_rawequal(L, -1, -2);
-    lua_pop(L, 2);
-    return metatablesMatch;
+    std::string path;
+    int status = LUA_ERRFILE;
+    if (!vm.chunk_cache_dir.empty()) {
+        char file[64];
+#ifdef LUA_VERSION_RELEASE_NUM
+        snprintf(file, sizeof(file), "/%016llx-%zx-%d.luac", (unsigned long long)key, src.size(), (int)LUA_VERSION_RELEASE_NUM);
+#else
+        snprintf(file, sizeof(file), "/%016llx-%zx-%d.luac", (unsigned long long)key, src.size(), (int)LUA_VERSION_NUM);
+#endif
+        path = vm.chunk_cache_dir + file;
+        std::string bytecode;
+        if (detail::ReadFile(path, bytecode)) {
+            status = luaL_loadbufferx(L, bytecode.data(), bytecode.size(), name.c_str(), "b");
+            if (status != LUA_OK) lua_pop(L, 1);  // 损坏 重新编译并覆盖
+        }
+    }
+    if (status != LUA_OK) {
+        status = luaL_loadbufferx(L, src.data(), src.size(), name.c_str(), "t");
+        if (status != LUA_OK) {
+            return status;
+        }
+        if (!path.empty()) {
+            detail::WriteFile(path, LuaDump(L));
+        }
+    }
+    detail::ChunkCachePut(L, vm, key, name, src);
+    return LUA_OK;
 }
 
-template <typename T>
-int LuaStructIs(lua_State *L, int index) {
-    const char *name = reflection::GetTypeName<T>();
-    return LuaStructIs(L, name, index);
+// dir 非空时启用磁盘缓存 目录需已存在
+inline void LuaSetChunkCacheDir(lua_State *L, std::string dir) { GetLuaVMData(L).chunk_cache_dir = std::move(dir); }
+
+// 内存中最多保留 max 个代码块 0 表示不缓存
+inline void LuaSetChunkCacheMax(lua_State *L, size_t max) {
+    LuaVMData &vm = GetLuaVMData(L);
+    vm.chunk_cache_max = max;
+    while (vm.chunks.size() > max) {
+        luaL_unref(L, LUA_REGISTRYINDEX, vm.chunks.back().ref);
+        vm.chunk_index.erase(vm.chunks.back().key);
+        vm.chunks.pop_back();
+    }
 }
 
-inline const char *LuaStructFieldname(lua_State *L, int index, size_t *length) {
-    luaL_argcheck(L, lua_type(L, index) == LUA_TSTRING, index, "Field name must be a string");
+// 清空当前 VM 的编译缓存 磁盘上的文件保留
+inline void LuaClearChunkCache(lua_State *L) {
+    LuaVMData &vm = GetLuaVMData(L);
+    for (auto &chunk : vm.chunks) luaL_unref(L, LUA_REGISTRYINDEX, chunk.ref);
+    vm.chunks.clear();
+    vm.chunk_index.clear();
+}
 
-    return lua_tolstring(L, index, length);
+namespace detail {
+
+int SandboxIndex(lua_State *L);
+
+// 代理表被调用时转为调用基础表 基础表元表中的 __call 收到的仍是基础表
+inline int SandboxCall(lua_State *L) {
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_replace(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    return lua_gettop(L);
 }
 
-template <typename T>
-auto LuaStructTodata_w(lua_State *L, const char *metatable, int index, bool required) -> T * {
-    if (required == false && lua_isnoneornil(L, index)) {
-        return NULL;
+// 压入基础表 base 对应的代理元表 {__index = SandboxIndex} 按 base 缓存在 cache 中 所有沙箱共用
+// base 自己带 __call 时 (类表/构造表) 代理元表也转发 __call
+inline void PushSandboxMeta(lua_State *L, int base, int cache) {
+    base = lua_absindex(L, base);
+    cache = lua_absindex(L, cache);
+    lua_pushvalue(L, base);
+    if (lua_rawget(L, cache) == LUA_TTABLE) {
+        return;
     }
-    LUASTRUCT_CDATA *reference = (LUASTRUCT_CDATA *)luaL_checkudata(L, index, metatable);
-    if (reference->ref == LUA_NOREF) {
-        return (T *)(reference + 1);
-    } else {
-        return *((T **)(reference + 1));
+    lua_pop(L, 1);
+    lua_createtable(L, 0, 2);
+    lua_pushvalue(L, base);
+    lua_pushvalue(L, cache);
+    lua_pushcclosure(L, SandboxIndex, 2);
+    lua_setfield(L, -2, "__index");
+    if (luaL_getmetafield(L, base, "__call") != LUA_TNIL) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, base);
+        lua_pushcclosure(L, SandboxCall, 1);
+        lua_setfield(L, -2, "__call");
     }
+    lua_pushvalue(L, base);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, cache);
 }
 
-template <typename T>
-auto LuaStructTodata(lua_State *L, int index, bool required = true) -> T * {
-    const char *typeName = reflection::GetTypeName<T>();
-    return LuaStructTodata_w<T>(L, typeName, index, required);
+// 代理表 (沙箱环境或其中的子表) 未命中时从基础表读取并缓存到代理表 之后的读取不再进入此函数
+// 子表 (包括带元表的类表与命名空间) 换成该沙箱自己的空代理 写入只落在代理上 基础表保持不变
+// 基础表带元表时 只缓存其自身含有的键 经 __index 算出的值每次重新读取
+inline int SandboxIndex(lua_State *L) {
+    lua_settop(L, 2);
+    lua_pushvalue(L, 2);
+    int t = lua_gettable(L, lua_upvalueindex(1));
+    if (t == LUA_TNIL) {
+        return 1;
+    }
+    if (t == LUA_TTABLE) {
+        lua_newtable(L);
+        PushSandboxMeta(L, 3, lua_upvalueindex(2));
+        lua_setmetatable(L, -2);
+        lua_replace(L, 3);
+    }
+    if (lua_getmetatable(L, lua_upvalueindex(1))) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, 2);
+        bool raw = lua_rawget(L, lua_upvalueindex(1)) != LUA_TNIL;
+        lua_pop(L, 1);
+        if (!raw) {
+            return 1;
+        }
+    }
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_rawset(L, 1);
+    return 1;
 }
 
-template <typename T>
-void LuaStructPush(lua_State *L, const T &value) {
-    const char *typeName = reflection::GetTypeName<T>();
-    LuaStructNew(L, typeName, sizeof(T));
-    T *ptr = LuaStructTodata_w<T>(L, typeName, -1, true);
-    *ptr = value;
+}  // namespace detail
+
+// 以 idx 处的表作为共享的基础环境 返回供 LuaSandboxNew 使用的句柄 (注册表引用)
+// 基础表之后不应再被修改: 已被沙箱读取并缓存的值不会更新
+// 只读只对经由环境取到的表成立 通过其他途径拿到的原表 (getmetatable("").__index 基础函数的返回值与上值等) 仍可被修改
+// 不可信的脚本不应拿到这类函数
+inline int LuaSandboxBase(lua_State *L, int idx) {
+    idx = lua_absindex(L, idx);
+    luaL_checktype(L, idx, LUA_TTABLE);
+    lua_newtable(L);  // 子表 -> 代理元表
+    detail::PushSandboxMeta(L, idx, -1);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+    return ref;
 }
 
-template <typename T>
-struct is_struct {
-    static constexpr bool value = std::is_class<T>::value;
-};
+// 压入一个新的沙箱环境 只创建一张空表 与基础环境大小无关
+// pairs 只遍历沙箱自己写入或已读取过的键
+inline void LuaSandboxNew(lua_State *L, int base) {
+    lua_newtable(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, base);
+    lua_setmetatable(L, -2);
+}
 
-template <typename T>
-struct LuaStructAccess {
-    static inline int Get(lua_State *L, const char *fieldName, T *data, int parentIndex, int set, int valueIndex) {
-        if constexpr (is_struct<T>::value) {
-            if (set) {
-                *data = *LuaStructTodata<T>(L, valueIndex);
-                return 0;
-            } else {
-                return LuaStructNewRef(L, reflection::GetTypeName<T>(), parentIndex, data);
-            }
-        } else {
-            if (set) {
-                detail::LuaStack::Get<T>(L, valueIndex, *data);
-                return 0;
-            } else {
-                detail::LuaStack::Push(L, *data);
-                return 1;
-            }
-        }
+// 以 env 处的表作为 _ENV 执行 src 编译结果经 LuaLoadCached 在所有沙箱间共享
+// 环境通过 "local _ENV = ..." 作为参数传入 不修改缓存函数的上值 脚本中的 ... 以环境开头
+// chunkname 默认取自原始源码 (不含注入的前缀) 前缀不换行 行号与原始源码一致
+inline LuaResult<void> LuaSandboxRun(lua_State *L, int env, std::string_view src, const char *chunkname = nullptr) {
+    env = lua_absindex(L, env);
+    std::string name = chunkname ? chunkname : std::string(src.substr(0, 60));
+    std::string chunk = "local _ENV = ...; ";
+    chunk += src;
+    if (int status = LuaLoadCached(L, chunk, name.c_str()); status != LUA_OK) {
+        return LuaPopError(L, status);
     }
-};
-
-enum { NEKOLUA_INVALID_TYPE = -1 };
+    lua_pushvalue(L, env);
+    return LuaCall(L, 1, 0);
+}
 
-typedef lua_Integer LuaTypeid;
-typedef int (*neko_luabind_Pushfunc)(lua_State *, LuaTypeid, const void *);
-typedef void (*neko_luabind_Tofunc)(lua_State *, LuaTypeid, void *, int);
+// 在工作线程中编译得到的字节码 保留源码 加载时以与 LuaLoadCached 相同的键写入编译缓存
+struct LuaCompiled {
+    std::string name;
+    std::string source;
+    std::string bytecode;
+    std::string error;
 
-struct LuaTypeinfo {
-    const char *name;
-    size_t size;
+    bool Ok() const { return error.empty(); }
 };
 
-template <typename T>
-LuaTypeid LuaType(lua_State *L) {
+// 可在任意线程调用 每个线程复用一个不打开标准库的临时 lua_State
+inline LuaCompiled LuaCompile(std::string_view src, std::string name) {
+    struct Scratch {
+        lua_State *L = luaL_newstate();
+        ~Scratch() {
+            if (L) lua_close(L);
+        }
+    };
+    static thread_local Scratch scratch;
+    lua_State *L = scratch.L;
+
+    LuaCompiled out;
+    out.name = std::move(name);
+    out.source = src;
+    if (L == nullptr) {
+        out.error = "not enough memory";
+        return out;
+    }
+    if (luaL_loadbufferx(L, src.data(), src.size(), out.name.c_str(), "t") != LUA_OK) {
+        const char *msg = lua_tostring(L, -1);
+        out.error = msg ? msg : "syntax error";
+    } else {
+        out.bytecode = LuaDump(L);
+    }
+    lua_settop(L, 0);
+    return out;
+}
 
-    const char *type = reflection::GetTypeName<T>();
-    constexpr size_t size = sizeof(T);
+namespace detail {
 
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_ids");
-    lua_getfield(L, -1, type);
+// LuaCompileAsync 的常驻工作线程 按提交顺序逐个编译 线程内的临时 lua_State 在多次调用间复用
+class CompileWorker {
+public:
+    static CompileWorker &Get() {
+        static CompileWorker worker;
+        return worker;
+    }
 
-    if (lua_isnumber(L, -1)) {
+    std::future<LuaCompiled> Submit(std::string src, std::string name) {
+        std::packaged_task<LuaCompiled()> task([src = std::move(src), name = std::move(name)]() mutable { return LuaCompile(src, std::move(name)); });
+        std::future<LuaCompiled> f = task.get_future();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.push_back(std::move(task));
+        }
+        m_cv.notify_one();
+        return f;
+    }
 
-        LuaTypeid id = lua_tointeger(L, -1);
-        lua_pop(L, 2);
-        return id;
+    ~CompileWorker() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_one();
+        m_thread.join();
+    }
 
-    } else {
+private:
+    CompileWorker() : m_thread([this] { Run(); }) {}
+
+    // 退出前先做完已提交的任务 future 不会悬空
+    void Run() {
+        for (;;) {
+            std::packaged_task<LuaCompiled()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+                if (m_queue.empty()) return;
+                task = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+            task();
+        }
+    }
 
-        lua_pop(L, 2);
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::packaged_task<LuaCompiled()>> m_queue;
+    bool m_stop = false;
+    std::thread m_thread;  // 最后初始化 其余成员就绪后才开始运行
+};
 
-        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_index");
+}  // namespace detail
 
-        LuaTypeid id = lua_tointeger(L, -1);
-        lua_pop(L, 1);
-        id++;
+// 交给常驻工作线程编译 src 的副本 与主线程的帧执行重叠
+inline std::future<LuaCompiled> LuaCompileAsync(std::string src, std::string name) { return detail::CompileWorker::Get().Submit(std::move(src), std::move(name)); }
 
-        lua_pushinteger(L, id);
-        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_index");
+// 用 threads 个工作线程 (0 为硬件线程数) 编译一批脚本 结果与输入顺序一致
+inline std::vector<LuaCompiled> LuaCompileAll(std::span<const std::pair<std::string, std::string>> sources, unsigned threads = 0) {
+    std::vector<LuaCompiled> out(sources.size());
+    std::atomic<size_t> next{0};
+    auto work = [&]() {
+        for (size_t i = next++; i < sources.size(); i = next++) {
+            out[i] = LuaCompile(sources[i].second, sources[i].first);
+        }
+    };
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = (unsigned)std::min<size_t>(threads, sources.size());
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; ++i) pool.emplace_back(work);
+    work();
+    for (auto &t : pool) t.join();
+    return out;
+}
+
+// 在 VM 所在线程加载预编译的字节码并压入函数 同时写入编译缓存 (与 LuaLoadCached 同样受 LRU 上限约束)
+// 之后以相同 chunkname 与源码调用 LuaLoadCached 直接命中
+// 编译失败时压入错误信息并返回 LUA_ERRSYNTAX
+inline int LuaLoadCompiled(lua_State *L, const LuaCompiled &c) {
+    if (!c.Ok()) {
+        lua_pushlstring(L, c.error.data(), c.error.size());
+        return LUA_ERRSYNTAX;
+    }
+    int status = luaL_loadbufferx(L, c.bytecode.data(), c.bytecode.size(), c.name.c_str(), "b");
+    if (status != LUA_OK) {
+        return status;
+    }
+    LuaVMData &vm = GetLuaVMData(L);
+    detail::ChunkCachePut(L, vm, detail::ChunkKey(c.name, c.source), c.name, c.source);
+    return LUA_OK;
+}
+
+int LuaEventFlush(lua_State *L);
+LuaAsyncPollResult LuaAsyncPoll(lua_State *L);
+
+enum class LuaAllocPolicy {
+    Pool,    // 每个 VM 独立的分级内存池 (默认)
+    System,  // realloc/free
+};
+
+// 按 16 字节分级的小块内存池 每个 VM 一个 只被运行该 VM 的线程访问 无需加锁
+// 小块从 64KB 的 chunk 中切出 释放后挂回对应级别的空闲链表 chunk 在 VM 关闭后整体释放
+// 超过 kMaxSmall 的块直接走 malloc
+class LuaPoolAlloc {
+public:
+    static constexpr size_t kAlign = 16;
+    static constexpr size_t kMaxSmall = 512;
+    static constexpr size_t kClasses = kMaxSmall / kAlign;
+    static constexpr size_t kChunkSize = 64 * 1024;
+
+    LuaPoolAlloc() = default;
+    LuaPoolAlloc(const LuaPoolAlloc &) = delete;
+    LuaPoolAlloc &operator=(const LuaPoolAlloc &) = delete;
+
+    ~LuaPoolAlloc() {
+        for (void *c : m_chunks) ::free(c);
+    }
+
+    static size_t ClassOf(size_t size) { return size == 0 ? 0 : (size - 1) / kAlign; }
+
+    // ptr 为空时 osize 须为 0 nsize 不为 0
+    void *Realloc(void *ptr, size_t osize, size_t nsize) {
+        if (ptr == nullptr) {
+            return Alloc(nsize);
+        }
+        if (osize > kMaxSmall && nsize > kMaxSmall) {
+            return ::realloc(ptr, nsize);
+        }
+        if (osize <= kMaxSmall && nsize <= kMaxSmall && ClassOf(osize) == ClassOf(nsize)) {
+            return ptr;
+        }
+        void *p = Alloc(nsize);
+        if (p == nullptr) {
+            // 收缩时原块仍然可用 Lua 会把收缩失败当作内存错误 所以留在原处
+            // 留下的大块之后按小块释放会挂进空闲链表 记入 m_chunks 由析构释放
+            if (nsize < osize) {
+                if (osize > kMaxSmall) m_chunks.push_back(ptr);
+                return ptr;
+            }
+            return nullptr;
+        }
+        memcpy(p, ptr, osize < nsize ? osize : nsize);
+        Free(ptr, osize);
+        return p;
+    }
+
+    void *Alloc(size_t size) {
+        if (size > kMaxSmall) {
+            return ::malloc(size);
+        }
+        size_t c = ClassOf(size);
+        if (FreeNode *n = m_free[c]) {
+            m_free[c] = n->next;
+            return n;
+        }
+        size_t bytes = (c + 1) * kAlign;
+        if (m_cur + bytes > m_end) {
+            char *chunk = static_cast<char *>(::malloc(kChunkSize));
+            if (chunk == nullptr) return nullptr;
+            m_chunks.push_back(chunk);
+            m_cur = chunk;
+            m_end = chunk + kChunkSize;
+        }
+        void *p = m_cur;
+        m_cur += bytes;
+        return p;
+    }
+
+    void Free(void *p, size_t size) {
+        if (size > kMaxSmall) {
+            ::free(p);
+            return;
+        }
+        size_t c = ClassOf(size);
+        auto *n = static_cast<FreeNode *>(p);
+        n->next = m_free[c];
+        m_free[c] = n;
+    }
+
+    size_t ChunkCount() const { return m_chunks.size(); }
+
+private:
+    struct FreeNode {
+        FreeNode *next;
+    };
+
+    FreeNode *m_free[kClasses] = {};
+    char *m_cur = nullptr;
+    char *m_end = nullptr;
+    std::vector<void *> m_chunks;
+};
+
+// 每个 VM 的内存统计 allocs 按 LuaPoolAlloc 的尺寸级别计数 最后一项为大块
+struct LuaMemStats {
+    size_t bytes = 0;
+    size_t peak = 0;
+    size_t limit = 0;  // 0 表示不限制
+    u64 allocs[LuaPoolAlloc::kClasses + 1] = {};
+    u64 frees = 0;
+    u64 freed_bytes = 0;
+    u64 failed = 0;  // 因超出 limit 或系统内存不足而失败的分配
+};
+
+namespace detail {
+
+// lua_newstate 不安装 panic 与警告处理 以下与 luaL_newstate 的默认行为一致
+inline int LuaPanic(lua_State *L) {
+    const char *msg = lua_tostring(L, -1);
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", msg ? msg : "error object is not a string");
+    fflush(stderr);
+    return 0;  // 返回后 Lua 调用 abort
+}
+
+inline void LuaWarnOff(void *ud, const char *msg, int tocont);
+inline void LuaWarnOn(void *ud, const char *msg, int tocont);
+
+// 控制消息 "@on" / "@off" 默认关闭
+inline bool LuaWarnControl(lua_State *L, const char *msg, int tocont) {
+    if (tocont || *(msg++) != '@') return false;
+    if (strcmp(msg, "off") == 0) {
+        lua_setwarnf(L, LuaWarnOff, L);
+    } else if (strcmp(msg, "on") == 0) {
+        lua_setwarnf(L, LuaWarnOn, L);
+    }
+    return true;
+}
+
+inline void LuaWarnOff(void *ud, const char *msg, int tocont) { LuaWarnControl((lua_State *)ud, msg, tocont); }
+
+inline void LuaWarnCont(void *ud, const char *msg, int tocont) {
+    lua_State *L = (lua_State *)ud;
+    fprintf(stderr, "%s", msg);
+    if (tocont) {
+        lua_setwarnf(L, LuaWarnCont, L);
+    } else {
+        fprintf(stderr, "\n");
+        fflush(stderr);
+        lua_setwarnf(L, LuaWarnOn, L);
+    }
+}
+
+inline void LuaWarnOn(void *ud, const char *msg, int tocont) {
+    if (LuaWarnControl((lua_State *)ud, msg, tocont)) return;
+    fprintf(stderr, "Lua warning: ");
+    LuaWarnCont(ud, msg, tocont);
+}
+
+}  // namespace detail
+
+// lua_newstate 的 ud 按 policy 分配并记账 由 LuaVM::Fini 在 lua_close 之后释放
+// 超出 limit 时返回 NULL: Lua 随即做一次紧急 full GC 并重试 仍失败则抛出内存错误
+struct LuaVMAlloc {
+    LuaAllocPolicy policy = LuaAllocPolicy::Pool;
+    LuaMemStats stats;
+    LuaPoolAlloc pool;
+
+    static void *Allocf(void *ud, void *ptr, size_t osize, size_t nsize) {
+        auto *a = static_cast<LuaVMAlloc *>(ud);
+        LuaMemStats &st = a->stats;
+        if (ptr == nullptr) osize = 0;  // 此时 osize 是对象类型 不是大小
+        if (nsize == 0) {
+            if (ptr) {
+                a->policy == LuaAllocPolicy::Pool ? a->pool.Free(ptr, osize) : ::free(ptr);
+                st.bytes -= osize;
+                st.freed_bytes += osize;
+                ++st.frees;
+            }
+            return nullptr;
+        }
+        if (st.limit != 0 && nsize > osize && st.bytes + (nsize - osize) > st.limit) {
+            ++st.failed;
+            return nullptr;
+        }
+        void *p = a->policy == LuaAllocPolicy::Pool ? a->pool.Realloc(ptr, osize, nsize) : ::realloc(ptr, nsize);
+        if (p == nullptr && nsize < osize) {
+            p = ptr;  // 收缩失败 原块仍可用
+        }
+        if (p == nullptr) {
+            ++st.failed;
+            return nullptr;
+        }
+        st.bytes = st.bytes - osize + nsize;
+        if (st.bytes > st.peak) st.peak = st.bytes;
+        ++st.allocs[nsize > LuaPoolAlloc::kMaxSmall ? LuaPoolAlloc::kClasses : LuaPoolAlloc::ClassOf(nsize)];
+        return p;
+    }
+};
+
+// 由 LuaVM::Create 创建的 VM 返回其内存统计 其他分配器返回 nullptr
+inline LuaMemStats *LuaGetMemStats(lua_State *L) {
+    void *ud = nullptr;
+    if (lua_getallocf(L, &ud) != LuaVMAlloc::Allocf) {
+        return nullptr;
+    }
+    return &static_cast<LuaVMAlloc *>(ud)->stats;
+}
+
+namespace detail {
+
+// 按 cfg 切换到其中的模式并设置该模式的参数 (0 为 Lua 默认值) 不改变手动/自动回收
+inline void ApplyGCMode(lua_State *L, const LuaGCConfig &cfg) {
+#if LUA_VERSION_NUM >= 504
+    if (cfg.generational) {
+        lua_gc(L, LUA_GCGEN, cfg.minormul, cfg.majormul);
+    } else {
+        lua_gc(L, LUA_GCINC, cfg.pause, cfg.stepmul, 0);
+    }
+#else
+    if (cfg.pause) lua_gc(L, LUA_GCSETPAUSE, cfg.pause);
+    if (cfg.stepmul) lua_gc(L, LUA_GCSETSTEPMUL, cfg.stepmul);
+#endif
+}
+
+// GCStep 统计用的标记: 有内存统计时为累计释放字节数 否则为当前内存用量
+inline u64 GCMark(lua_State *L) {
+    if (const LuaMemStats *mem = LuaGetMemStats(L)) {
+        return mem->freed_bytes;
+    }
+    return (u64)lua_gc(L, LUA_GCCOUNT, 0) * 1024 + (u64)lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+}  // namespace detail
+
+struct LuaVM {
+
+    struct Tools {
+
+        static void check_arg_count(lua_State *L, int expected) {
+            int n = lua_gettop(L);
+            if (n != expected) {
+                luaL_error(L, "Got %d arguments, expected %d", n, expected);
+                return;
+            }
+            return;
+        };
+
+        template <typename T>
+        static void ForEachTable(lua_State *L, T f, int index, int indent = 0) {
+            lua_pushnil(L);
+            while (lua_next(L, index) != 0) {
+                // for (int i = 0; i < indent; i++) f(" ");
+                if (lua_type(L, -2) == LUA_TSTRING) {
+                    f(index, lua_tostring(L, -2));
+                } else if (lua_type(L, -2) == LUA_TNUMBER) {
+                    f(index, lua_tonumber(L, -2));
+                } else {
+                    f(index, lua_typename(L, lua_type(L, -2)));
+                }
+
+                if (lua_type(L, -1) == LUA_TSTRING) {
+                    f(index, lua_tostring(L, -1));
+                } else if (lua_type(L, -1) == LUA_TNUMBER) {
+                    f(index, lua_tonumber(L, -1));
+                } else if (lua_type(L, -1) == LUA_TTABLE) {
+                    f(index, "table");
+                    ForEachTable(L, f, lua_gettop(L), indent + 1);
+                } else {
+                    f(index, lua_typename(L, lua_type(L, -1)));
+                }
+                lua_pop(L, 1);
+            }
+        }
+
+        template <typename T>
+        static void ForEachStack(lua_State *L, T f) {
+            int top = lua_gettop(L);
+            for (int i = 1; i <= top; i++) {
+                int t = lua_type(L, i);
+                switch (t) {
+                    case LUA_TSTRING:
+                        f(i, lua_tostring(L, i));
+                        break;
+                    case LUA_TBOOLEAN:
+                        f(i, lua_toboolean(L, i) ? "true" : "false");
+                        break;
+                    case LUA_TNUMBER:
+                        f(i, lua_tonumber(L, i));
+                        break;
+                    case LUA_TTABLE:
+                        f(i, "table:");
+                        ForEachTable(L, f, i);
+                        break;
+                    default:
+                        f(i, lua_typename(L, t));
+                        break;
+                }
+            }
+        }
+    };
+
+    lua_State *L;
+
+    LuaVM() = default;
+    LuaVM(lua_State *l) : L(l) {}
+
+    inline lua_State *Create(LuaAllocPolicy policy = LuaAllocPolicy::Pool) {
+
+        auto *alloc = new LuaVMAlloc();
+        alloc->policy = policy;
+        lua_State *L = ::lua_newstate(LuaVMAlloc::Allocf, alloc);
+        if (L == nullptr) {
+            delete alloc;
+            return nullptr;
+        }
+        lua_atpanic(L, detail::LuaPanic);
+        lua_setwarnf(L, detail::LuaWarnOff, L);
+
+        ::luaL_openlibs(L);
+        detail::InstallBudgetResume(L);
+
+        // 安装默认的 traceback 错误处理函数
+        luax_pushmsgh(L);
+        lua_pop(L, 1);
+
+#ifdef NEKO_CFFI
+        this->L = L;
+        SetGCParams(150);
+#endif
+
+        lua_pushinteger(L, 0);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_index");
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_ids");
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_names");
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_sizes");
+
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "stack_push");
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "stack_to");
+
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_values");
+
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs");
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_sizes");
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_fields");
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_layout");
+
+        lua_newtable(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "lazy");
+
+        luaL_Reg builtin_funcs[] = {
+                {"nameof", Wrap<l_nameof>},
+        };
+
+        for (auto f : builtin_funcs) {
+            lua_register(L, f.name, f.func);
+        }
+
+        this->L = L;
+
+        return L;
+    }
+
+    inline void Fini(lua_State *L) {
+        if (L) {
+
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_index");
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_ids");
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_names");
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_sizes");
+
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "stack_push");
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "stack_to");
+
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_values");
+
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs");
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_sizes");
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_fields");
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_layout");
+
+            lua_pushnil(L);
+            lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "lazy");
+
+            int top = lua_gettop(L);
+            if (top != 0) {
+                Tools::ForEachStack(L, []<typename T>(int i, T v) -> int {
+                    std::cout << i << ':' << v << std::endl;
+                    return 0;
+                });
+                printf("luastack memory leak\n");
+            }
+            void *ud = nullptr;
+            lua_Alloc f = lua_getallocf(L, &ud);
+            ::lua_close(L);
+            if (f == LuaVMAlloc::Allocf) {
+                delete static_cast<LuaVMAlloc *>(ud);  // 内存池的所有 chunk 一次释放
+            }
+            if (this->L == L) this->L = nullptr;
+        }
+    }
+
+    // template <typename T>
+    operator lua_State *() { return L; }
+
+    // 当前 VM 的内存统计 只对 Create 创建的 VM 有效
+    inline const LuaMemStats &MemStats() const {
+        static const LuaMemStats none;
+        const LuaMemStats *st = LuaGetMemStats(L);
+        return st ? *st : none;
+    }
+
+    // 内存上限 (字节) 0 表示不限制 超出时先紧急 GC 再以内存错误使分配失败
+    inline void SetMemoryLimit(size_t bytes) {
+        if (LuaMemStats *st = LuaGetMemStats(L)) st->limit = bytes;
+    }
+
+    enum class GCMode { Incremental, Generational };
+
+    // 分代模式需要 Lua 5.4 更早的版本忽略 切换时带上该模式已设置的参数
+    inline void SetGCMode(GCMode mode) {
+        LuaGCConfig &cfg = GetLuaVMData(L).gc_config;
+        cfg.generational = mode == GCMode::Generational;
+        detail::ApplyGCMode(L, cfg);
+    }
+
+    // 增量模式的 pause 与 stepmul (百分比) 0 表示保持不变
+    // 分代模式下只记录 切换回增量模式时生效
+    inline void SetGCParams(int pause, int stepmul = 0) {
+        LuaGCConfig &cfg = GetLuaVMData(L).gc_config;
+        if (pause) cfg.pause = pause;
+        if (stepmul) cfg.stepmul = stepmul;
+        if (!cfg.generational) detail::ApplyGCMode(L, cfg);
+    }
+
+    // 分代模式的 minor 与 major 乘数 (百分比) 0 表示保持不变
+    // 增量模式下只记录 切换到分代模式时生效
+    inline void SetGCGenParams(int minormul, int majormul = 0) {
+        LuaGCConfig &cfg = GetLuaVMData(L).gc_config;
+        if (minormul) cfg.minormul = minormul;
+        if (majormul) cfg.majormul = majormul;
+        if (cfg.generational) detail::ApplyGCMode(L, cfg);
+    }
+
+    // 停止自动回收 改由每帧的 GCStep 驱动
+    inline void SetGCManual(bool manual) {
+        GetLuaVMData(L).gc_config.manual = manual;
+        lua_gc(L, manual ? LUA_GCSTOP : LUA_GCRESTART, 0);
+    }
+
+    // 在帧边界执行最多 budget_us 微秒的回收步进 完成一个周期时提前返回 true
+    // 每次只做一个基本步进 单步无法被打断 实际耗时可能略超预算
+    inline bool GCStep(double budget_us) {
+        using clock = std::chrono::steady_clock;
+        LuaGCStats &gc = GetLuaVMData(L).gc;
+        if (!gc.started) {
+            gc.started = true;
+            gc.cycle_mark = detail::GCMark(L);
+        }
+        auto start = clock::now();
+        bool finished = false;
+        double elapsed = 0;
+        do {
+            finished = lua_gc(L, LUA_GCSTEP, 0) != 0;
+            elapsed = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+        } while (!finished && elapsed < budget_us);
+        gc.cycle_us += elapsed;
+        if (finished) {
+            ++gc.cycles;
+            gc.last_cycle_us = gc.cycle_us;
+            gc.cycle_us = 0;
+            u64 mark = detail::GCMark(L);
+            if (LuaGetMemStats(L)) {
+                gc.last_collected = (size_t)(mark - gc.cycle_mark);
+            } else {
+                gc.last_collected = gc.cycle_mark > mark ? (size_t)(gc.cycle_mark - mark) : 0;
+            }
+            gc.cycle_mark = mark;
+        }
+        return finished;
+    }
+
+    inline const LuaGCStats &GCStats() { return GetLuaVMData(L).gc; }
+
+    // 分发所有排队的事件 返回分发的事件数
+    inline int FlushEvents() { return LuaEventFlush(L); }
+
+    // 恢复所有异步操作已完成的协程 返回恢复的个数与其中的错误
+    inline LuaAsyncPollResult PollAsync() { return LuaAsyncPoll(L); }
+
+    inline void operator()(const std::string &func) const {
+        lua_getglobal(L, func.c_str());
+        luax_pcall(L, 0, 0);
+    }
+
+    // RunString 默认每次重新编译 开启后经过 LuaLoadCached 的 LRU 缓存
+    inline void SetChunkCache(bool enable, size_t max = 128) {
+        GetLuaVMData(L).chunk_cache_run_string = enable;
+        LuaSetChunkCacheMax(L, max);
+    }
+
+    // 启用 RunString 的字节码磁盘缓存 目录需已存在 (同时开启内存缓存)
+    inline void SetChunkCacheDir(std::string dir) {
+        GetLuaVMData(L).chunk_cache_run_string = true;
+        LuaSetChunkCacheDir(L, std::move(dir));
+    }
+
+    // 写时复制的沙箱环境 见 LuaSandboxBase / LuaSandboxNew
+    inline int SandboxBase(int idx) { return LuaSandboxBase(L, idx); }
+    inline void NewSandbox(int base) { LuaSandboxNew(L, base); }
+    inline LuaResult<void> RunSandboxed(int env, std::string_view src, const char *chunkname = nullptr) { return LuaSandboxRun(L, env, src, chunkname); }
+
+    // 在预算内调用全局函数 超出预算或出错时返回错误
+    inline LuaResult<void> operator()(const std::string &func, const LuaBudget &budget) const {
+        lua_getglobal(L, func.c_str());
+        return LuaCall(L, 0, 0, budget);
+    }
+
+    inline LuaResult<void> RunString(const std::string &str, const LuaBudget &budget) {
+        LuaGlobalsChanged(L);
+        if (int status = LoadString(str); status != LUA_OK) {
+            return LuaPopError(L, status);
+        }
+        return LuaCall(L, 0, 0, budget);
+    }
+
+    inline void RunString(const std::string &str) {
+        LuaGlobalsChanged(L);  // 脚本可能重新定义全局函数
+        if (LoadString(str) != LUA_OK) {
+            std::string err = lua_tostring(L, -1);
+            ::lua_pop(L, 1);
+            printf("%s", err.c_str());
+            return;
+        }
+        luax_pcall(L, 0, LUA_MULTRET);
+    }
+
+private:
+    inline int LoadString(const std::string &str) {
+        if (GetLuaVMData(L).chunk_cache_run_string) {
+            return LuaLoadCached(L, str);
+        }
+        return luaL_loadstring(L, str.c_str());
+    }
+};
+
+namespace detail {
+
+inline const int reset_point_key = 0;
+
+// 记录 idx 处表的浅拷贝与元表 copies[t] = {k = v...} metas[t] = mt 或 false
+inline void ResetPointTrack(lua_State *L, int copies, int metas, int idx) {
+    idx = lua_absindex(L, idx);
+    lua_pushvalue(L, idx);
+    if (lua_rawget(L, copies) != LUA_TNIL) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, idx);
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_rawset(L, copies);
+    lua_pushvalue(L, idx);
+    if (!lua_getmetatable(L, idx)) {
+        lua_pushboolean(L, 0);
+    }
+    lua_rawset(L, metas);
+}
+
+// 记录 idx 处的表以及其中直接包含的表 (例如 _G.string 与 package.loaded)
+inline void ResetPointTrackTree(lua_State *L, int copies, int metas, int idx, int self) {
+    idx = lua_absindex(L, idx);
+    ResetPointTrack(L, copies, metas, idx);
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        if (lua_type(L, -1) == LUA_TTABLE && !lua_rawequal(L, -1, self)) {
+            ResetPointTrack(L, copies, metas, -1);
+        }
+        lua_pop(L, 1);
+    }
+}
+
+}  // namespace detail
+
+// 以当前的注册表与全局变量 (连同其中直接包含的表) 作为重置点 同时记录内存上限与回收设置
+// 只做两层浅拷贝 不是隔离边界: 更深层表的内容 string 等类型的元表 库函数的上值等修改不会被 LuaReset 撤销
+inline void LuaSaveResetPoint(lua_State *L) {
+    LuaVMData &vm = GetLuaVMData(L);  // 先创建 使其属于重置点 不会在 LuaReset 时被移除
+    const LuaMemStats *mem = LuaGetMemStats(L);
+    vm.reset_mem_limit = mem ? mem->limit : 0;
+    vm.reset_gc_config = vm.gc_config;
+    lua_createtable(L, 2, 0);
+    int point = lua_gettop(L);
+    lua_newtable(L);
+    lua_rawseti(L, point, 1);
+    lua_newtable(L);
+    lua_rawseti(L, point, 2);
+    lua_pushvalue(L, point);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &detail::reset_point_key);
+    lua_rawgeti(L, point, 1);
+    lua_rawgeti(L, point, 2);
+    int copies = point + 1, metas = point + 2;
+    detail::ResetPointTrackTree(L, copies, metas, LUA_REGISTRYINDEX, point);
+    lua_pushglobaltable(L);
+    detail::ResetPointTrackTree(L, copies, metas, -1, point);
+    lua_settop(L, point - 1);
+}
+
+// 恢复到 LuaSaveResetPoint 时的状态: 删除之后新增的键 还原被修改的值与元表
+// 之后创建的注册表引用全部失效: LuaRef/LuaFunction/WeakLuaRef/LuaTask 等包装按 LuaRefGeneration 识别
+// 析构时不再释放槽位 (但不能再使用) luax_callback_ref 返回的整数句柄需在重置前自行释放
+// 没有重置点时返回 false
+inline bool LuaReset(lua_State *L) {
+    lua_settop(L, 0);
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &detail::reset_point_key) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_rawgeti(L, 1, 1);  // copies
+    lua_rawgeti(L, 1, 2);  // metas
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+        int t = lua_gettop(L) - 1, copy = t + 1;
+        lua_pushnil(L);
+        while (lua_next(L, t)) {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            if (lua_rawget(L, copy) == LUA_TNIL) {
+                lua_pushvalue(L, -2);
+                lua_pushnil(L);
+                lua_rawset(L, t);  // 遍历中允许清除已有的键
+            }
+            lua_pop(L, 1);
+        }
+        lua_pushnil(L);
+        while (lua_next(L, copy)) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, t);
+        }
+        lua_pushvalue(L, t);
+        if (lua_rawget(L, 3) == LUA_TTABLE) {
+            lua_setmetatable(L, t);
+        } else {
+            lua_pop(L, 1);
+            lua_pushnil(L);
+            lua_setmetatable(L, t);
+        }
+        lua_pop(L, 1);  // copy 保留键 t 继续遍历
+    }
+    lua_settop(L, 0);
+    LuaVMData &vm = GetLuaVMData(L);
+    vm.ResetRuntime();
+    if (LuaMemStats *mem = LuaGetMemStats(L)) mem->limit = vm.reset_mem_limit;
+    vm.gc_config = vm.reset_gc_config;
+    detail::ApplyGCMode(L, vm.gc_config);
+    lua_gc(L, vm.gc_config.manual ? LUA_GCSTOP : LUA_GCRESTART, 0);
+    return true;
+}
+
+// 预先初始化好的 VM 池 setup 在每个新 VM 上执行一次 (LuaStruct/LuaEnum/绑定等注册)
+// 之后保存重置点 Release 时恢复到该点而不关闭 VM 可在多个线程中借出与归还
+class LuaVMPool {
+public:
+    using Setup = std::function<void(lua_State *)>;
+
+    explicit LuaVMPool(Setup setup, size_t prewarm = 0, LuaAllocPolicy policy = LuaAllocPolicy::Pool) : m_setup(std::move(setup)), m_policy(policy) {
+        for (size_t i = 0; i < prewarm; ++i) {
+            m_idle.push_back(Make());
+        }
+    }
+
+    LuaVMPool(const LuaVMPool &) = delete;
+    LuaVMPool &operator=(const LuaVMPool &) = delete;
+
+    ~LuaVMPool() {
+        for (LuaVM &vm : m_idle) vm.Fini(vm.L);
+    }
+
+    LuaVM Acquire() {
+        {
+            std::lock_guard lock(m_mutex);
+            if (!m_idle.empty()) {
+                LuaVM vm = m_idle.back();
+                m_idle.pop_back();
+                return vm;
+            }
+        }
+        return Make();
+    }
+
+    // 重置在调用线程上完成 不持有池的锁
+    void Release(LuaVM vm) {
+        if (vm.L == nullptr) {
+            return;
+        }
+        if (LuaReset(vm.L)) {
+            std::lock_guard lock(m_mutex);
+            if (m_idle.size() < max_idle) {
+                m_idle.push_back(vm);
+                return;
+            }
+        }
+        vm.Fini(vm.L);
+    }
+
+    size_t IdleCount() const {
+        std::lock_guard lock(m_mutex);
+        return m_idle.size();
+    }
+
+    size_t max_idle = 64;
+
+private:
+    LuaVM Make() {
+        LuaVM vm;
+        vm.Create(m_policy);
+        if (m_setup) m_setup(vm.L);
+        lua_settop(vm.L, 0);
+        LuaSaveResetPoint(vm.L);
+        return vm;
+    }
+
+    Setup m_setup;
+    LuaAllocPolicy m_policy;
+    mutable std::mutex m_mutex;
+    std::vector<LuaVM> m_idle;
+};
+
+inline void DumpLuaRef(const LuaRef &ref) {
+    ref.Push();  // 把 LuaRef 存的值推到 Lua 栈顶
+    LuaVM::Tools::ForEachStack(ref.L, []<typename T>(int i, T v) -> int {
+        std::cout << i << ':' << v << std::endl;
+        return 0;
+    });
+    lua_pop(ref.L, 1);  // 清理 Lua 栈
+}
+
+namespace LuaValue {
+template <class>
+inline constexpr bool always_false_v = false;
+
+using Value = std::variant<std::monostate,  // LUA_TNIL
+                           bool,            // LUA_TBOOLEAN
+                           void *,          // LUA_TLIGHTUSERDATA
+                           lua_Integer,     // LUA_TNUMBER
+                           lua_Number,      // LUA_TNUMBER
+                           std::string,     // LUA_TSTRING
+                           lua_CFunction    // LUA_TFUNCTION
+                           >;
+using Table = std::map<std::string, Value>;
+
+inline void Set(lua_State *L, int idx, Value &v) {
+    switch (lua_type(L, idx)) {
+        case LUA_TNIL:
+            v.emplace<std::monostate>();
+            break;
+        case LUA_TBOOLEAN:
+            v.emplace<bool>(!!lua_toboolean(L, idx));
+            break;
+        case LUA_TLIGHTUSERDATA:
+            v.emplace<void *>(lua_touserdata(L, idx));
+            break;
+        case LUA_TNUMBER:
+            if (lua_isinteger(L, idx)) {
+                v.emplace<lua_Integer>(lua_tointeger(L, idx));
+            } else {
+                v.emplace<lua_Number>(lua_tonumber(L, idx));
+            }
+            break;
+        case LUA_TSTRING: {
+            size_t sz = 0;
+            const char *str = lua_tolstring(L, idx, &sz);
+            v.emplace<std::string>(str, sz);
+            break;
+        }
+        case LUA_TFUNCTION: {
+            lua_CFunction func = lua_tocfunction(L, idx);
+            if (func == NULL || lua_getupvalue(L, idx, 1) != NULL) {
+                luaL_error(L, "Only light C function can be serialized");
+                return;
+            }
+            v.emplace<lua_CFunction>(func);
+            break;
+        }
+        default:
+            luaL_error(L, "Unsupport type %s to serialize", lua_typename(L, idx));
+    }
+}
+
+inline void Set(lua_State *L, int idx, Table &t) {
+    luaL_checktype(L, idx, LUA_TTABLE);
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        size_t sz = 0;
+        const char *str = luaL_checklstring(L, -2, &sz);
+        std::pair<std::string, Value> pair;
+        pair.first.assign(str, sz);
+        Set(L, -1, pair.second);
+        t.emplace(pair);
+        lua_pop(L, 1);
+    }
+}
+
+inline void Get(lua_State *L, const Value &v) {
+    std::visit(
+            [=](auto &&arg) {
+                using T = std::decay_t<decltype(arg)>;
+                if constexpr (std::is_same_v<T, std::monostate>) {
+                    lua_pushnil(L);
+                } else if constexpr (std::is_same_v<T, bool>) {
+                    lua_pushboolean(L, arg);
+                } else if constexpr (std::is_same_v<T, void *>) {
+                    lua_pushlightuserdata(L, arg);
+                } else if constexpr (std::is_same_v<T, lua_Integer>) {
+                    lua_pushinteger(L, arg);
+                } else if constexpr (std::is_same_v<T, lua_Number>) {
+                    lua_pushnumber(L, arg);
+                } else if constexpr (std::is_same_v<T, std::string>) {
+                    lua_pushlstring(L, arg.data(), arg.size());
+                } else if constexpr (std::is_same_v<T, lua_CFunction>) {
+                    lua_pushcfunction(L, arg);
+                } else {
+                    static_assert(always_false_v<T>, "non-exhaustive visitor!");
+                }
+            },
+            v);
+}
+
+inline void Get(lua_State *L, const Table &t) {
+    lua_createtable(L, 0, static_cast<int>(t.size()));
+    for (const auto &[k, v] : t) {
+        lua_pushlstring(L, k.data(), k.size());
+        Get(L, v);
+        lua_rawset(L, -3);
+    }
+}
+
+}  // namespace LuaValue
+
+int vfs_lua_loader(lua_State *L);
+
+struct LUASTRUCT_CDATA {
+    int ref;
+    u32 gen;  // ref 创建时的 LuaRefGeneration
+    size_t cdata_size;
+    const_str type_name;
+};
+
+// 惰性注册: 启动时只记录 类型名 -> 注册函数 首次使用该类型时调用一次
+inline void LuaLazyRegister(lua_State *L, const char *name, lua_CFunction init) {
+    if (lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "lazy") != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "lazy");
+    }
+    lua_pushcfunction(L, init);
+    lua_setfield(L, -2, name);
+    lua_pop(L, 1);
+}
+
+// 类型仍待注册时完成注册并返回 true
+inline bool LuaLazyEnsure(lua_State *L, const char *name) {
+    if (lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "lazy") != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return false;
+    }
+    if (lua_getfield(L, -1, name) != LUA_TFUNCTION) {
+        lua_pop(L, 2);
+        return false;
+    }
+    lua_pushnil(L);
+    lua_setfield(L, -3, name);  // 先移除 注册过程中再次使用该类型不会递归
+    lua_remove(L, -2);
+    lua_call(L, 0, 0);
+    return true;
+}
+
+static inline void LuaStructSetMetatable(lua_State *L, const char *metatable, int index) {
+    if (luaL_getmetatable(L, metatable) == LUA_TNIL) {
+        lua_pop(L, 1);
+        if (LuaLazyEnsure(L, metatable)) {
+            luaL_getmetatable(L, metatable);
+        } else {
+            luaL_error(L, "The metatable for %s has not been defined", metatable);
+        }
+    }
+    lua_setmetatable(L, index - 1);
+}
+
+inline int LuaStructNew(lua_State *L, const char *metatable, size_t size) {
+    LUASTRUCT_CDATA *reference = (LUASTRUCT_CDATA *)lua_newuserdata(L, sizeof(LUASTRUCT_CDATA) + size);
+    std::memset(reference, 0, sizeof(LUASTRUCT_CDATA) + size);
+    reference->ref = LUA_NOREF;
+    reference->cdata_size = size;
+    reference->type_name = metatable;
+    void *data = (void *)(reference + 1);
+    memset(data, 0, size);
+    LuaStructSetMetatable(L, metatable, -1);
+    return 1;
+}
+
+// ParentIndex 是包含对象的堆栈索引 或者 0 表示不包含对象
+inline int LuaStructNewRef(lua_State *L, const char *metatable, int parentIndex, const void *data) {
+    LUASTRUCT_CDATA *reference = (LUASTRUCT_CDATA *)lua_newuserdata(L, sizeof(LUASTRUCT_CDATA) + sizeof(data));
+
+    if (parentIndex != 0) {
+        // 存储对包含对象的引用
+        lua_pushvalue(L, parentIndex);
+        reference->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        reference->gen = LuaRefGeneration(L);
+    } else {
+        reference->ref = LUA_REFNIL;
+    }
+
+    *((const void **)(reference + 1)) = data;
+
+    LuaStructSetMetatable(L, metatable, -1);
+
+    return 1;
+}
+
+inline int LuaStructGC(lua_State *L, const char *metatable) {
+    LUASTRUCT_CDATA *reference = (LUASTRUCT_CDATA *)luaL_checkudata(L, 1, metatable);
+    // printf("LuaStructGC %s %d %p\n", metatable, reference->ref, reference);
+    detail::UnrefChecked(L, reference->ref, reference->gen);
+    return 0;
+}
+
+inline int LuaStructIs(lua_State *L, const char *metatable, int index) {
+    if (lua_type(L, index) != LUA_TUSERDATA) {
+        return 0;
+    }
+    lua_getmetatable(L, index);
+    luaL_getmetatable(L, metatable);
+    int metatablesMatch = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return metatablesMatch;
+}
+
+template <typename T>
+int LuaStructIs(lua_State *L, int index) {
+    const char *name = reflection::GetTypeName<T>();
+    return LuaStructIs(L, name, index);
+}
+
+inline const char *LuaStructFieldname(lua_State *L, int index, size_t *length) {
+    luaL_argcheck(L, lua_type(L, index) == LUA_TSTRING, index, "Field name must be a string");
+
+    return lua_tolstring(L, index, length);
+}
+
+template <typename T>
+auto LuaStructTodata_w(lua_State *L, const char *metatable, int index, bool required) -> T * {
+    if (required == false && lua_isnoneornil(L, index)) {
+        return NULL;
+    }
+    LUASTRUCT_CDATA *reference = (LUASTRUCT_CDATA *)luaL_checkudata(L, index, metatable);
+    if (reference->ref == LUA_NOREF) {
+        return (T *)(reference + 1);
+    } else {
+        return *((T **)(reference + 1));
+    }
+}
+
+template <typename T>
+auto LuaStructTodata(lua_State *L, int index, bool required = true) -> T * {
+    const char *typeName = reflection::GetTypeName<T>();
+    return LuaStructTodata_w<T>(L, typeName, index, required);
+}
+
+template <typename T>
+void LuaStructPush(lua_State *L, const T &value) {
+    const char *typeName = reflection::GetTypeName<T>();
+    LuaStructNew(L, typeName, sizeof(T));
+    T *ptr = LuaStructTodata_w<T>(L, typeName, -1, true);
+    *ptr = value;
+}
+
+template <typename T>
+struct is_struct {
+    static constexpr bool value = std::is_class<T>::value;
+};
+
+template <typename T>
+struct LuaStructAccess {
+    static inline int Get(lua_State *L, const char *fieldName, T *data, int parentIndex, int set, int valueIndex) {
+        if constexpr (is_struct<T>::value) {
+            if (set) {
+                *data = *LuaStructTodata<T>(L, valueIndex);
+                return 0;
+            } else {
+                return LuaStructNewRef(L, reflection::GetTypeName<T>(), parentIndex, data);
+            }
+        } else {
+            if (set) {
+                detail::LuaStack::Get<T>(L, valueIndex, *data);
+                return 0;
+            } else {
+                detail::LuaStack::Push(L, *data);
+                return 1;
+            }
+        }
+    }
+};
+
+enum { NEKOLUA_INVALID_TYPE = -1 };
+
+typedef lua_Integer LuaTypeid;
+typedef int (*neko_luabind_Pushfunc)(lua_State *, LuaTypeid, const void *);
+typedef void (*neko_luabind_Tofunc)(lua_State *, LuaTypeid, void *, int);
+
+struct LuaTypeinfo {
+    const char *name;
+    size_t size;
+};
+
+namespace detail {
+
+template <typename T>
+LuaTypeid LuaTypeUncached(lua_State *L) {
+
+    const char *type = reflection::GetTypeName<T>();
+    constexpr size_t size = sizeof(T);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_ids");
+    lua_getfield(L, -1, type);
+
+    if (lua_isnumber(L, -1)) {
+
+        LuaTypeid id = lua_tointeger(L, -1);
+        lua_pop(L, 2);
+        return id;
+
+    } else {
+
+        lua_pop(L, 2);
+
+        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_index");
+
+        LuaTypeid id = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        id++;
+
+        lua_pushinteger(L, id);
+        lua_setfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_index");
+
+        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_ids");
+        lua_pushinteger(L, id);
+        lua_setfield(L, -2, type);
+        lua_pop(L, 1);
+
+        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_names");
+        lua_pushinteger(L, id);
+        lua_pushstring(L, type);
+        lua_settable(L, -3);
+        lua_pop(L, 1);
+
+        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_sizes");
+        lua_pushinteger(L, id);
+        lua_pushinteger(L, size);
+        lua_settable(L, -3);
+        lua_pop(L, 1);
+
+        return id;
+    }
+}
+
+}  // namespace detail
+
+// 类型 id 在每个 VM 中只查一次注册表 之后为数组访问
+// 首次使用时完成惰性注册 注册可能使缓存数组扩容 之后需重新取条目
+template <typename T>
+LuaTypeid LuaType(lua_State *L) {
+    LuaVMData::TypeCache *cache = &LuaTypeCacheEntry<T>(L);
+    if (cache->id == 0) {
+        if (LuaLazyEnsure(L, reflection::GetTypeName<T>())) {
+            cache = &LuaTypeCacheEntry<T>(L);
+        }
+        if (cache->id == 0) {
+            cache->id = detail::LuaTypeUncached<T>(L);
+        }
+    }
+    return cache->id;
+}
+
+inline auto TypeFind(lua_State *L, const char *type) -> LuaTypeid {
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_ids");
+    lua_getfield(L, -1, type);
+    LuaTypeid id = lua_isnil(L, -1) ? NEKOLUA_INVALID_TYPE : lua_tointeger(L, -1);
+    lua_pop(L, 2);
+    return id;
+}
+
+template <typename T>
+inline LuaTypeinfo GetLuaTypeinfo(lua_State *L, T id);
+
+template <>
+inline LuaTypeinfo GetLuaTypeinfo(lua_State *L, LuaTypeid id) {
+
+    LuaTypeinfo typeinfo{};
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_names");
+    lua_pushinteger(L, id);
+    lua_gettable(L, -2);
+
+    typeinfo.name = lua_isnil(L, -1) ? "NEKOLUA_INVALID_TYPE" : lua_tostring(L, -1);
+    lua_pop(L, 2);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_sizes");
+    lua_pushinteger(L, id);
+    lua_gettable(L, -2);
+
+    typeinfo.size = lua_isnil(L, -1) ? -1 : lua_tointeger(L, -1);
+    lua_pop(L, 2);
+
+    return typeinfo;
+}
+
+template <>
+inline LuaTypeinfo GetLuaTypeinfo(lua_State *L, const char *name) {
+    return GetLuaTypeinfo(L, TypeFind(L, name));
+}
+
+// 结构体能否按原始字节保存: 可平凡复制且没有指针字段 (指针在新进程中无意义)
+template <typename T>
+constexpr bool LuaStructSnapshotable = std::is_trivially_copyable_v<T> && []<std::size_t... I>(std::index_sequence<I...>) {
+    return (!std::is_pointer_v<std::remove_all_extents_t<reflection::field_type<T, I>>> && ...);
+}(std::make_index_sequence<reflection::field_count<T>>{});
+
+// 内存布局的哈希: 大小与每个字段的名字 类型名 偏移 大小 用于判断快照能否直接 memcpy
+// 不能按字节保存的类型返回 0 快照与恢复都会跳过
+template <typename T>
+u64 LuaStructLayoutHash() {
+    if constexpr (!LuaStructSnapshotable<T>) {
+        return 0;
+    } else {
+        static const u64 hash = [] {
+            std::string sig = std::to_string(sizeof(T));
+            const char *base = reinterpret_cast<const char *>(&reflection::storage<T>);
+            [&]<std::size_t... I>(std::index_sequence<I...>) {
+                ((sig += ';',
+                  sig += reflection::field_name<T, I>,
+                  sig += ':',
+                  sig += reflection::name_v<reflection::field_type<T, I>>.data(),
+                  sig += ':' + std::to_string(reinterpret_cast<const char *>(&reflection::field_access<I>(reflection::storage<T>)) - base),
+                  sig += ':' + std::to_string(sizeof(reflection::field_type<T, I>))),
+                 ...);
+            }(std::make_index_sequence<reflection::field_count<T>>{});
+            return fnv1a(sig.data(), sig.size());
+        }();
+        return hash;
+    }
+}
+
+template <typename T>
+inline void LuaStructAddType(lua_State *L, LuaTypeid type) {
+    constexpr auto N = reflection::field_count<T>;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_layout");
+    lua_pushinteger(L, type);
+    lua_pushinteger(L, (lua_Integer)LuaStructLayoutHash<T>());
+    lua_settable(L, -3);
+    lua_pop(L, 1);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs");
+    lua_pushinteger(L, type);
+    lua_newtable(L);
+    lua_settable(L, -3);
+    lua_pop(L, 1);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_fields");
+    lua_pushinteger(L, type);
+    lua_newtable(L);
+    lua_settable(L, -3);
+    lua_pop(L, 1);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_sizes");
+    lua_pushinteger(L, type);
+    lua_pushinteger(L, N);
+    lua_settable(L, -3);
+    lua_pop(L, 1);
+}
+
+inline void LuaStructAddField(lua_State *L, LuaTypeid type, const char *field_type, const char *field_name) {
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs");
+    lua_pushinteger(L, type);
+    lua_gettable(L, -2);
+
+    if (!lua_isnil(L, -1)) {
+
+        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_sizes");
+        lua_pushinteger(L, type);
+        lua_gettable(L, -2);
+        size_t size = lua_tointeger(L, -1);
+        lua_pop(L, 2);
+
+        lua_newtable(L);
+
+        lua_pushstring(L, field_type);
+        lua_setfield(L, -2, "value");
+
+        lua_pushstring(L, field_name);
+        lua_setfield(L, -2, "name");
+
+        lua_setfield(L, -2, field_name);
+
+        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_fields");
+        lua_pushinteger(L, type);
+        lua_gettable(L, -2);
+        lua_pushstring(L, field_type);
+        lua_getfield(L, -4, field_name);
+        lua_settable(L, -3);
+
+        lua_pop(L, 4);
+        return;
+    }
+
+    lua_pop(L, 2);
+    lua_pushfstring(L, "LuaStructAddValue: Struct '%s' not registered!", GetLuaTypeinfo(L, type).name);
+    lua_error(L);
+}
+
+inline bool LuaTypeIsStruct(lua_State *L, LuaTypeid type) {
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs");
+    lua_pushinteger(L, type);
+    lua_gettable(L, -2);
+    bool reg = !lua_isnil(L, -1);
+    lua_pop(L, 2);
+    return reg;
+}
+
+// 在栈顶的命名空间表中创建构造表 {new, metatype}
+inline void LuaStructCreateCtor(lua_State *L, const char *fieldName, const char *type_name, size_t type_size) {
+    lua_createtable(L, 0, 0);
+
+    lua_pushinteger(L, type_size);
+    lua_pushstring(L, type_name);
+
+    lua_pushcclosure(
+            L,
+            [](lua_State *L) -> int {
+                size_t _type_size = lua_tointeger(L, lua_upvalueindex(1));
+                const char *_type_name = lua_tostring(L, lua_upvalueindex(2));
+                return LuaStructNew(L, _type_name, _type_size);
+            },
+            2);
+    lua_setfield(L, -2, "new");
+
+    lua_pushstring(L, type_name);
+    lua_pushcclosure(
+            L,
+            [](lua_State *L) -> int {
+                const char *_type_name = lua_tostring(L, lua_upvalueindex(1));
+                luaL_getmetatable(L, _type_name);
+
+                int mt1_idx = lua_absindex(L, -1);
+                int mt2_idx = lua_absindex(L, 1);
+
+                lua_pushnil(L);
+                while (lua_next(L, mt2_idx) != 0) {
+                    const char *key = luaL_checkstring(L, -2);
+                    u64 keyhash = fnv1a(key);
+                    if (keyhash == "__tostring"_hash ||  //
+                        keyhash == "__index"_hash ||     //
+                        keyhash == "__newindex"_hash ||  //
+                        keyhash == "__gc"_hash ||        //
+                        keyhash == "__metatable"_hash) {
+                        lua_pop(L, 1);
+                        printf("metatype with %s is not allow\n", key);
+                        continue;
+                    } else {
+                        lua_pushvalue(L, -2);      // 复制 key
+                        lua_insert(L, -2);         // 交换 key 和 value
+                        lua_settable(L, mt1_idx);  // mt1[key] = value
+                    }
+                }
+                return 0;
+            },
+            1);
+    lua_setfield(L, -2, "metatype");
+
+    lua_setfield(L, -2, fieldName);
+}
+
+template <typename T>
+inline void LuaStructCreate(lua_State *L, const char *fieldName, const char *type_name, size_t type_size, T fieldaccess) {
+
+    using fieldaccess_func = T;
+
+    if (fieldName) {
+        LuaStructCreateCtor(L, fieldName, type_name, type_size);
+    }
+
+    // 创建实例元表
+    luaL_newmetatable(L, type_name);
+
+    lua_pushstring(L, type_name);
+    lua_pushcclosure(
+            L,
+            [](lua_State *L) -> int {
+                const char *_type_name = lua_tostring(L, lua_upvalueindex(1));
+                return LuaStructGC(L, _type_name);
+            },
+            1);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushstring(L, type_name);
+    lua_pushcclosure(
+            L,
+            [](lua_State *L) -> int {
+                const char *_type_name = lua_tostring(L, lua_upvalueindex(1));
+                lua_pushstring(L, _type_name);
+                return 1;
+            },
+            1);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pushboolean(L, 0);
+    lua_pushcclosure(L, fieldaccess, 1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushboolean(L, 1);
+    lua_pushcclosure(L, fieldaccess, 1);
+    lua_setfield(L, -2, "__newindex");
+
+    lua_pop(L, 1);
+}
+
+template <typename T, std::size_t I>
+int LuaStructField_w(lua_State *L, const char *typeName, const char *field, int set, T &v) {
+
+    int index = 1;
+
+    if constexpr (I < reflection::field_count<T>) {
+        constexpr std::string_view name = reflection::field_name<T, I>;
+        // lua_getfield(L, arg, name.data());
+
+        if (name == field) {
+            // printf("LUASTRUCT_FIELD_W %s.%s\n", typeName, field);
+            auto &af = reflection::field_access<I>(v);
+            return LuaStructAccess<reflection::field_type<T, I>>::Get(L, field, &af, index, set, index + 2);
+        }
+
+        // reflection::field_access<I>(v) = unpack<reflection::field_type<D, I>>(L, -1);
+        // lua_pop(L, 1);
+        return LuaStructField_w<T, I + 1>(L, typeName, field, set, v);
+    }
+
+    return luaL_error(L, "Invalid field %s.%s", typeName, field);
+};
+
+namespace detail {
+
+template <typename T>
+int LuaStructFieldAccess(lua_State *L) {
+    int index = 1;
+    int set = lua_toboolean(L, lua_upvalueindex(1));
+
+    // printf("fieldaccess %d\n", set);
+
+    const char *typeName = reflection::GetTypeName<T>();
+    T *data = LuaStructTodata<T>(L, index);
+    size_t length = 0;
+    const char *field = LuaStructFieldname(L, index + 1, &length);
+
+    // printf("fieldaccess %s\n", field);
+
+    return LuaStructField_w<T, 0>(L, typeName, field, set, *data);
+}
+
+// 惰性注册的第一步: 实例元表与类型信息 由 LuaLazyEnsure 调用
+template <typename T>
+int LuaStructLazyInit(lua_State *L) {
+    LuaStructCreate(L, nullptr, reflection::GetTypeName<T>(), sizeof(T), LuaStructFieldAccess<T>);
+    LuaStructAddType<T>(L, LuaType<T>(L));
+    return 0;
+}
+
+// 命名空间表的 __index(ns, key) 元表中以 key 记录的构造器存在时创建对应的构造表
+inline int LuaLazyIndex(lua_State *L) {
+    if (!lua_getmetatable(L, 1) || lua_type(L, 2) != LUA_TSTRING) {
+        return 0;
+    }
+    lua_pushvalue(L, 2);
+    if (lua_rawget(L, -2) != LUA_TFUNCTION) {
+        return 0;
+    }
+    lua_pushvalue(L, 2);
+    lua_pushnil(L);
+    lua_rawset(L, -4);  // 只构造一次
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_call(L, 2, 0);
+    lua_settop(L, 2);
+    lua_rawget(L, 1);
+    return 1;
+}
+
+template <typename T>
+int LuaStructLazyCtor(lua_State *L) {
+    const char *name = reflection::GetTypeName<T>();
+    LuaLazyEnsure(L, name);
+    lua_settop(L, 2);
+    lua_pushvalue(L, 1);
+    LuaStructCreateCtor(L, lua_tostring(L, 2), name, sizeof(T));
+    return 0;
+}
+
+template <auto Init>
+int LuaEnumLazyInit(lua_State *L) {
+    Init(L);
+    return 0;
+}
+
+}  // namespace detail
+
+template <typename T>
+void LuaStruct(lua_State *L, const char *fieldName = reflection::GetTypeName<T>()) {
+    static_assert(std::is_standard_layout_v<T>);
+
+    LuaStructCreate(L, fieldName, reflection::GetTypeName<T>(), sizeof(T), detail::LuaStructFieldAccess<T>);
+
+    // lua_setglobal(L, fieldName);
+
+    LuaStructAddType<T>(L, LuaType<T>(L));
+}
+
+// 与 LuaStruct 用法相同 但只记录注册函数 元表在首次 LuaPush/LuaGet 时创建
+// 构造表在 Lua 首次访问 ns.fieldName 时创建 (为栈顶的命名空间表设置 __index)
+// 命名空间表已有别的元表时报错 不往其中写入构造器
+template <typename T>
+void LuaStructLazy(lua_State *L, const char *fieldName = reflection::GetTypeName<T>()) {
+    static_assert(std::is_standard_layout_v<T>);
+
+    if (lua_getmetatable(L, -1)) {
+        lua_getfield(L, -1, "__index");
+        bool lazy = lua_tocfunction(L, -1) == detail::LuaLazyIndex;
+        lua_pop(L, 1);
+        if (!lazy) {
+            lua_pop(L, 1);
+            luaL_error(L, "LuaStructLazy: namespace for %s already has a metatable", fieldName);
+            return;
+        }
+    } else {
+        lua_createtable(L, 0, 1);
+        lua_pushcfunction(L, detail::LuaLazyIndex);
+        lua_setfield(L, -2, "__index");
+        lua_pushvalue(L, -1);
+        lua_setmetatable(L, -3);
+    }
+    LuaLazyRegister(L, reflection::GetTypeName<T>(), detail::LuaStructLazyInit<T>);
+    lua_pushcfunction(L, detail::LuaStructLazyCtor<T>);
+    lua_setfield(L, -2, fieldName);
+    lua_pop(L, 1);
+}
+
+namespace detail {
+
+struct SnapshotWriter {
+    std::string out;
+
+    template <typename V>
+    void Put(V v) {
+        out.append(reinterpret_cast<const char *>(&v), sizeof(V));
+    }
+
+    void PutBytes(const void *p, size_t n) {
+        Put((u32)n);
+        out.append(static_cast<const char *>(p), n);
+    }
+};
+
+struct SnapshotReader {
+    std::string_view in;
+    bool ok = true;
+
+    template <typename V>
+    V Get() {
+        V v{};
+        if (in.size() < sizeof(V)) {
+            ok = false;
+            return v;
+        }
+        memcpy(&v, in.data(), sizeof(V));
+        in.remove_prefix(sizeof(V));
+        return v;
+    }
+
+    std::string_view GetBytes() {
+        u32 n = Get<u32>();
+        if (!ok || in.size() < n) {
+            ok = false;
+            return {};
+        }
+        std::string_view r = in.substr(0, n);
+        in.remove_prefix(n);
+        return r;
+    }
+};
+
+inline constexpr u32 kSnapshotMagic = 0x53534c4e;  // "NLSS"
+
+// idx 处是自有数据的结构体 userdata 时返回其类型 id (通过 LuaStructRef 得到的引用不算)
+// 先由元表确认是已注册的结构体 再读取 LUASTRUCT_CDATA 头 其他 userdata 可能比头还小
+inline LuaTypeid SnapshotStructType(lua_State *L, int idx, const char **name) {
+    idx = lua_absindex(L, idx);
+    if (lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx)) {
+        return NEKOLUA_INVALID_TYPE;
+    }
+    LuaTypeid id = NEKOLUA_INVALID_TYPE;
+    if (lua_getfield(L, -1, "__name") == LUA_TSTRING) {
+        const char *n = lua_tostring(L, -1);
+        luaL_getmetatable(L, n);
+        LuaTypeid t = TypeFind(L, n);
+        if (lua_rawequal(L, -1, -3) && t != NEKOLUA_INVALID_TYPE && LuaTypeIsStruct(L, t)) {
+            id = t;
+            *name = n;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    if (id == NEKOLUA_INVALID_TYPE || lua_rawlen(L, idx) < sizeof(LUASTRUCT_CDATA)) {
+        return NEKOLUA_INVALID_TYPE;
+    }
+    auto *ref = (LUASTRUCT_CDATA *)lua_touserdata(L, idx);
+    return ref->ref == LUA_NOREF ? id : NEKOLUA_INVALID_TYPE;
+}
+
+inline u64 SnapshotLayout(lua_State *L, LuaTypeid id) {
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_layout");
+    lua_rawgeti(L, -1, id);
+    u64 hash = (u64)lua_tointeger(L, -1);
+    lua_pop(L, 2);
+    return hash;
+}
+
+// 深度优先遍历 t 中的表 记录每个结构体值的路径 (字符串/整数键) 类型名 布局哈希与原始字节
+inline void SnapshotWalk(lua_State *L, int t, int visited, std::vector<std::pair<int, lua_Integer>> &path, std::vector<std::string> &names, std::span<const LuaTypeid> types, SnapshotWriter &w,
+                         u32 &count) {
+    if (path.size() >= 32) return;
+    lua_pushvalue(L, t);
+    if (lua_rawget(L, visited) != LUA_TNIL) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, t);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, visited);
+
+    luaL_checkstack(L, 6, "LuaStructSnapshot: table nesting too deep");
+    lua_pushnil(L);
+    while (lua_next(L, t)) {
+        int kt = lua_type(L, -2), vt = lua_type(L, -1);
+        bool key_ok = kt == LUA_TSTRING || (kt == LUA_TNUMBER && lua_isinteger(L, -2));
+        if (key_ok && (vt == LUA_TTABLE || vt == LUA_TUSERDATA)) {
+            if (kt == LUA_TSTRING) {
+                size_t len = 0;
+                const char *k = lua_tolstring(L, -2, &len);
+                names.emplace_back(k, len);
+                path.push_back({LUA_TSTRING, (lua_Integer)names.size() - 1});
+            } else {
+                path.push_back({LUA_TNUMBER, lua_tointeger(L, -2)});
+            }
+            const char *name = nullptr;
+            LuaTypeid id = vt == LUA_TUSERDATA ? SnapshotStructType(L, -1, &name) : NEKOLUA_INVALID_TYPE;
+            if (vt == LUA_TTABLE) {
+                SnapshotWalk(L, lua_gettop(L), visited, path, names, types, w, count);
+            } else if (id != NEKOLUA_INVALID_TYPE && SnapshotLayout(L, id) != 0 && (types.empty() || std::find(types.begin(), types.end(), id) != types.end())) {
+                auto *ref = (LUASTRUCT_CDATA *)lua_touserdata(L, -1);
+                w.Put((u16)path.size());
+                for (auto &[type, key] : path) {
+                    w.Put((u8)type);
+                    if (type == LUA_TSTRING) {
+                        w.PutBytes(names[key].data(), names[key].size());
+                    } else {
+                        w.Put((i64)key);
+                    }
+                }
+                w.PutBytes(name, strlen(name));
+                w.Put(SnapshotLayout(L, id));
+                w.PutBytes(ref + 1, ref->cdata_size);
+                ++count;
+            }
+            if (path.back().first == LUA_TSTRING) names.pop_back();
+            path.pop_back();
+        }
+        lua_pop(L, 1);
+    }
+}
+
+}  // namespace detail
+
+// 热重载前保存从 root 处的表可达的所有结构体值 (LuaStruct 创建的自有数据) types 非空时只保存这些类型
+// 输出为紧凑的二进制: 每项为 路径 类型名 布局哈希 原始字节
+inline std::string LuaStructSnapshot(lua_State *L, int root, std::span<const LuaTypeid> types = {}) {
+    root = lua_absindex(L, root);
+    luaL_checktype(L, root, LUA_TTABLE);
+    detail::SnapshotWriter w;
+    w.Put(detail::kSnapshotMagic);
+    w.Put((u32)0);  // 项数 最后回填
+    u32 count = 0;
+    std::vector<std::pair<int, lua_Integer>> path;
+    std::vector<std::string> names;
+    lua_newtable(L);
+    detail::SnapshotWalk(L, root, lua_gettop(L), path, names, types, w, count);
+    lua_pop(L, 1);
+    memcpy(w.out.data() + sizeof(u32), &count, sizeof(u32));
+    return std::move(w.out);
+}
+
+struct LuaStructRestoreResult {
+    u32 restored = 0;  // 布局一致 直接 memcpy
+    u32 skipped = 0;   // 类型未注册 布局不一致或路径被非表值占用
+};
+
+// 把快照写回 root 处的表 (通常在新 VM 中重新加载脚本之后)
+// 路径上已有同类型的结构体时就地覆盖 否则新建结构体并补齐中间的表
+inline LuaStructRestoreResult LuaStructRestore(lua_State *L, int root, std::string_view snapshot) {
+    root = lua_absindex(L, root);
+    LuaStructRestoreResult result;
+    detail::SnapshotReader r{snapshot};
+    if (r.Get<u32>() != detail::kSnapshotMagic) {
+        return result;
+    }
+    u32 count = r.Get<u32>();
+    int top = lua_gettop(L);
+    for (u32 i = 0; i < count && r.ok; ++i) {
+        lua_settop(L, top);
+        lua_pushvalue(L, root);
+        u16 depth = r.Get<u16>();
+        bool path_ok = true;
+        for (u16 d = 0; d < depth && r.ok; ++d) {
+            u8 kt = r.Get<u8>();
+            if (kt == LUA_TSTRING) {
+                std::string_view k = r.GetBytes();
+                lua_pushlstring(L, k.data(), k.size());
+            } else {
+                lua_pushinteger(L, (lua_Integer)r.Get<i64>());
+            }
+            if (d + 1 == depth) break;  // 叶子的键留在栈上
+            if (!path_ok) {
+                lua_pop(L, 1);
+                continue;
+            }
+            lua_pushvalue(L, -1);
+            int t = lua_rawget(L, -3);
+            if (t == LUA_TNIL) {
+                lua_pop(L, 1);
+                lua_newtable(L);
+                lua_pushvalue(L, -2);
+                lua_pushvalue(L, -2);
+                lua_rawset(L, -5);
+            } else if (t != LUA_TTABLE) {
+                path_ok = false;
+            }
+            lua_remove(L, -2);  // 键
+            lua_remove(L, -2);  // 父表
+        }
+        std::string_view name = r.GetBytes();
+        u64 layout = r.Get<u64>();
+        std::string_view data = r.GetBytes();
+        if (!r.ok) break;
+        if (!path_ok || lua_type(L, -2) != LUA_TTABLE) {
+            ++result.skipped;
+            continue;
+        }
+        // 栈: 父表 键
+        std::string type_name(name);
+        LuaTypeid id = TypeFind(L, type_name.c_str());
+        if (id == NEKOLUA_INVALID_TYPE && LuaLazyEnsure(L, type_name.c_str())) {
+            id = TypeFind(L, type_name.c_str());
+        }
+        if (id == NEKOLUA_INVALID_TYPE || !LuaTypeIsStruct(L, id) || layout == 0 || detail::SnapshotLayout(L, id) != layout) {
+            ++result.skipped;
+            continue;
+        }
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);
+        const char *existing = nullptr;
+        if (detail::SnapshotStructType(L, -1, &existing) != id) {
+            lua_pop(L, 1);
+            luaL_getmetatable(L, type_name.c_str());
+            lua_getfield(L, -1, "__name");  // 元表持有的名字 生命期与类型相同
+            const char *stable = lua_tostring(L, -1);
+            lua_pop(L, 2);
+            LuaStructNew(L, stable, data.size());
+            lua_pushvalue(L, -2);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -5);
+        }
+        auto *ref = (LUASTRUCT_CDATA *)lua_touserdata(L, -1);
+        if (ref->cdata_size != data.size()) {
+            ++result.skipped;
+            continue;
+        }
+        memcpy(ref + 1, data.data(), data.size());
+        ++result.restored;
+    }
+    lua_settop(L, top);
+    return result;
+}
+
+#define neko_lua_enum_has_value(L, type, value)                \
+    const type __neko_lua_enum_value_temp_##value[] = {value}; \
+    neko_lua_enum_has_value_type(L, LuaType<type>(L), __neko_lua_enum_value_temp_##value)
+
+template <typename T, typename V>
+    requires std::is_same_v<T, LuaTypeid>
+inline bool LuaEnumHas(lua_State *L, T type, V v) {
+    using VT = std::remove_cv_t<V>;
+    if constexpr (std::is_integral_v<VT>) {
+        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_values");
+        lua_pushinteger(L, type);
+        lua_gettable(L, -2);
+        if (!lua_isnil(L, -1)) {
+            lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
+            lua_pushinteger(L, type);
+            lua_gettable(L, -2);
+            size_t size = lua_tointeger(L, -1);
+            lua_pop(L, 2);
+
+            // lua_Integer lvalue = 0;
+            // memcpy(&lvalue, v, size);
+
+            lua_pushinteger(L, v);
+            lua_gettable(L, -2);
+
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 3);
+                return false;
+            } else {
+                lua_pop(L, 3);
+                return true;
+            }
+        }
+        lua_pop(L, 2);
+        lua_pushfstring(L, "LuaEnumHas: Enum '%s' not registered!", GetLuaTypeinfo(L, type).name);
+        lua_error(L);
+        return false;
+    } else if constexpr (std::is_same_v<std::decay_t<VT>, char const *>) {
+        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
+        lua_pushinteger(L, type);
+        lua_gettable(L, -2);
+        if (!lua_isnil(L, -1)) {
+            lua_getfield(L, -1, v);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 3);
+                return false;
+            } else {
+                lua_pop(L, 3);
+                return true;
+            }
+        }
+        lua_pop(L, 2);
+        lua_pushfstring(L, "LuaEnumHas: Enum '%s' not registered!", GetLuaTypeinfo(L, type).name);
+        lua_error(L);
+        return false;
+    } else {
+        static_assert(!v, "LuaEnumHas type assert");
+    }
+}
+
+template <typename T, typename V>
+inline bool LuaEnumHas(lua_State *L, V v) {
+    return LuaEnumHas(L, LuaType<T>(L), v);
+}
+
+inline void LuaEnumAddType(lua_State *L, LuaTypeid type, size_t size) {
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
+    lua_pushinteger(L, type);
+    lua_newtable(L);
+    lua_settable(L, -3);
+    lua_pop(L, 1);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_values");
+    lua_pushinteger(L, type);
+    lua_newtable(L);
+    lua_settable(L, -3);
+    lua_pop(L, 1);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
+    lua_pushinteger(L, type);
+    lua_pushinteger(L, size);
+    lua_settable(L, -3);
+    lua_pop(L, 1);
+}
+
+inline void LuaEnumAddValue(lua_State *L, LuaTypeid type, const void *value, const char *name) {
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
+    lua_pushinteger(L, type);
+    lua_gettable(L, -2);
+
+    if (!lua_isnil(L, -1)) {
+
+        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
+        lua_pushinteger(L, type);
+        lua_gettable(L, -2);
+        size_t size = lua_tointeger(L, -1);
+        lua_pop(L, 2);
+
+        lua_newtable(L);
+
+        lua_Integer lvalue = 0;
+        memcpy(&lvalue, value, size);
+
+        lua_pushinteger(L, lvalue);
+        lua_setfield(L, -2, "value");
+
+        lua_pushstring(L, name);
+        lua_setfield(L, -2, "name");
+
+        lua_setfield(L, -2, name);
+
+        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_values");
+        lua_pushinteger(L, type);
+        lua_gettable(L, -2);
+        lua_pushinteger(L, lvalue);
+        lua_getfield(L, -4, name);
+        lua_settable(L, -3);
+
+        lua_pop(L, 4);
+        return;
+    }
+
+    lua_pop(L, 2);
+    lua_pushfstring(L, "LuaEnumAddValue: Enum '%s' not registered!", GetLuaTypeinfo(L, type).name);
+    lua_error(L);
+}
+
+inline bool LuaTypeIsEnum(lua_State *L, LuaTypeid type) {
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
+    lua_pushinteger(L, type);
+    lua_gettable(L, -2);
+    bool reg = !lua_isnil(L, -1);
+    lua_pop(L, 2);
+    return reg;
+}
+
+template <typename Enum, int min_value = -64, int max_value = 64>
+void LuaEnum(lua_State *L) {
+    std::map<int, std::string> values;
+    reflection::guess_enum_range<Enum, min_value>(values, std::make_integer_sequence<int, max_value - min_value>());
+    reflection::guess_enum_bit_range<Enum>(values, std::make_integer_sequence<int, 32>());
 
-        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_ids");
-        lua_pushinteger(L, id);
-        lua_setfield(L, -2, type);
+    LuaTypeid id = LuaType<Enum>(L);
+    LuaEnumAddType(L, id, sizeof(Enum));
+    for (const auto &value : values) {
+        const Enum enum_value[] = {(Enum)value.first};
+        LuaEnumAddValue(L, id, enum_value, value.second.c_str());
+    }
+}
+
+// 与 LuaEnum 相同 但值表在首次 LuaPush/LuaGet 该枚举时才生成
+template <typename Enum, int min_value = -64, int max_value = 64>
+void LuaEnumLazy(lua_State *L) {
+    LuaLazyRegister(L, reflection::GetTypeName<Enum>(), detail::LuaEnumLazyInit<&LuaEnum<Enum, min_value, max_value>>);
+}
+
+template <typename T>
+inline void LuaPush(lua_State *L, T &&v) {
+    detail::LuaStack::Push(L, std::forward<T>(v));
+}
+
+template <typename T>
+inline T LuaGet(lua_State *L, int index) {
+    T t{};
+    detail::LuaStack::Get(L, index, t);
+    return t;
+}
+
+inline int LuaTypePush(lua_State *L, LuaTypeid type_id, const void *c_in);
+
+namespace detail {
+
+// 枚举按名字压栈 名字缓存在每个 VM 的 值->名字 表中 命中时只有两次 rawgeti
+template <typename T>
+void PushEnum(lua_State *L, T v) {
+    LuaType<T>(L);  // 同时完成惰性注册
+    LuaVMData::TypeCache &cache = LuaTypeCacheEntry<T>(L);
+    if (cache.enum_names == LUA_NOREF) {
+        lua_newtable(L);
+        cache.enum_names = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cache.enum_names);
+    if (lua_rawgeti(L, -1, (lua_Integer)v) == LUA_TSTRING) {
+        lua_remove(L, -2);
+        return;
+    }
+    lua_pop(L, 1);
+    LuaTypePush(L, cache.id, &v);  // 未注册的值在这里报错
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, (lua_Integer)v);
+    lua_remove(L, -2);
+}
+
+}  // namespace detail
+
+template <typename T>
+    requires std::is_enum_v<T>
+inline void LuaPush(lua_State *L, const T &v) {
+    detail::PushEnum<T>(L, v);
+}
+
+template <typename T>
+    requires std::is_enum_v<T>
+inline auto LuaGet(lua_State *L, int index) -> T {
+    T type_val;
+    LuaTypeTo(L, LuaType<T>(L), &type_val, index);
+    return type_val;
+}
+
+template <typename T, std::size_t I>
+void LuaRawStructGet(lua_State *L, int arg, T &v);
+
+// template <typename T>
+//     requires std::is_pointer_v<T>
+// T LuaGet(lua_State *L, int arg) {
+//     luaL_checktype(L, arg, LUA_TLIGHTUSERDATA);
+//     return static_cast<T>(lua_touserdata(L, arg));
+// }
+
+template <>
+inline std::string_view LuaGet<std::string_view>(lua_State *L, int arg) {
+    size_t sz = 0;
+    const char *str = luaL_checklstring(L, arg, &sz);
+    return std::string_view(str, sz);
+}
+
+template <template <typename...> class Template, typename Class>
+struct is_instantiation : std::false_type {};
+template <template <typename...> class Template, typename... Args>
+struct is_instantiation<Template, Template<Args...>> : std::true_type {};
+template <typename Class, template <typename...> class Template>
+concept is_instantiation_of = is_instantiation<Template, Class>::value;
+
+template <typename T>
+    requires is_instantiation_of<T, std::map>
+T LuaGet(lua_State *L, int arg) {
+    arg = lua_absindex(L, arg);
+    luaL_checktype(L, arg, LUA_TTABLE);
+    T v;
+    lua_pushnil(L);
+    while (lua_next(L, arg)) {
+        auto key = LuaGet<typename T::key_type>(L, -2);
+        auto mapped = LuaGet<typename T::mapped_type>(L, -1);
+        v.emplace(std::move(key), std::move(mapped));
         lua_pop(L, 1);
+    }
+    return v;
+}
 
-        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_names");
-        lua_pushinteger(L, id);
-        lua_pushstring(L, type);
-        lua_settable(L, -3);
+template <typename T>
+    requires is_instantiation_of<T, std::vector>
+T LuaGet(lua_State *L, int arg) {
+    arg = lua_absindex(L, arg);
+    luaL_checktype(L, arg, LUA_TTABLE);
+    lua_Integer n = luaL_len(L, arg);
+    T v;
+    v.reserve((size_t)n);
+    for (lua_Integer i = 1; i <= n; ++i) {
+        lua_geti(L, arg, i);
+        auto value = LuaGet<typename T::value_type>(L, -1);
+        v.emplace_back(std::move(value));
         lua_pop(L, 1);
+    }
+    return v;
+}
 
-        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_sizes");
-        lua_pushinteger(L, id);
-        lua_pushinteger(L, size);
-        lua_settable(L, -3);
+template <typename T, std::size_t I>
+void LuaRawStructGet(lua_State *L, int arg, T &v) {
+    if constexpr (I < reflection::field_count<T>) {
+        constexpr auto name = reflection::field_name<T, I>;
+        lua_getfield(L, arg, name.data());
+        reflection::field_access<I>(v) = LuaGet<reflection::field_type<T, I>>(L, -1);
         lua_pop(L, 1);
+        LuaRawStructGet<T, I + 1>(L, arg, v);
+    }
+}
 
-        return id;
+template <typename T, std::size_t I>
+void LuaRawStructPush(lua_State *L, const T &v);
+
+template <typename T, std::size_t I>
+void LuaRawStructPush(lua_State *L, const T &v) {
+    if constexpr (I < reflection::field_count<T>) {
+        constexpr auto name = reflection::field_name<T, I>;
+        using FT = reflection::field_type<T, I>;
+        LuaPush(L, reflection::field_access<I>(v));
+        lua_setfield(L, -2, name.data());
+        LuaRawStructPush<T, I + 1>(L, v);
     }
 }
 
-inline auto TypeFind(lua_State *L, const char *type) -> LuaTypeid {
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_ids");
-    lua_getfield(L, -1, type);
-    LuaTypeid id = lua_isnil(L, -1) ? NEKOLUA_INVALID_TYPE : lua_tointeger(L, -1);
-    lua_pop(L, 2);
-    return id;
+namespace detail {
+
+// 标准库类型 (std::array 等) 不按 LuaStruct / LuaClass 传递
+template <typename T>
+inline constexpr bool is_std_type = reflection::name_raw<T>().starts_with("std::");
+
+}  // namespace detail
+
+// 编译期判断聚合类是否以 LuaStruct 传递 默认所有标准库以外的聚合类都是
+// 不注册而按表传递的类型特化为 false:
+// template <> struct is_lua_struct<Foo> : std::false_type {};
+template <typename T>
+struct is_lua_struct : std::bool_constant<std::is_class_v<T> && std::is_aggregate_v<T> && !detail::is_std_type<T>> {};
+
+// 编译期判断非聚合类是否以 LuaClass 传递 默认都不是 由 LuaClass 注册的类型需要显式特化:
+// template <> struct is_lua_class<Foo> : std::true_type {};
+template <typename T>
+struct is_lua_class : std::false_type {};
+
+template <typename T>
+    requires std::is_aggregate_v<T>
+void LuaPushRaw(lua_State *L, const T &v) {
+    lua_createtable(L, 0, (int)reflection::field_count<T>);
+    LuaRawStructPush<T, 0>(L, v);
+    return;
 }
 
 template <typename T>
-inline LuaTypeinfo GetLuaTypeinfo(lua_State *L, T id);
+    requires(std::is_aggregate_v<T>)
+inline void LuaPush(lua_State *L, const T &v) {
+    if constexpr (is_lua_struct<T>::value) {
+        assert(LuaTypeIsStruct(L, LuaType<T>(L)) && "struct is not registered with LuaStruct");
+        LuaStructPush<T>(L, v);
+    } else {
+        LuaPushRaw<T>(L, v);
+    }
+}
 
-template <>
-inline LuaTypeinfo GetLuaTypeinfo(lua_State *L, LuaTypeid id) {
+template <typename T>
+    requires std::is_aggregate_v<T>
+T LuaGetRaw(lua_State *L, int arg) {
+    T v;
+    LuaRawStructGet<T, 0>(L, arg, v);
+    return v;
+}
 
-    LuaTypeinfo typeinfo{};
+template <typename T>
+    requires(is_struct<T>::value && std::is_aggregate_v<T>)
+inline auto LuaGet(lua_State *L, int index) {
+    bool is_reg_struct = LuaTypeIsStruct(L, LuaType<T>(L));
+    T *v{};
+    if (is_reg_struct) {
+        v = LuaStructTodata<T>(L, index);
+    } else {  // 未经过注册的聚合类
+        assert(!"use LuaGetRaw");
+    }
+    return v;
+}
 
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_names");
-    lua_pushinteger(L, id);
+inline int LuaTypePush(lua_State *L, LuaTypeid type_id, const void *c_in) {
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "stack_push");
+    lua_pushinteger(L, type_id);
     lua_gettable(L, -2);
 
-    typeinfo.name = lua_isnil(L, -1) ? "NEKOLUA_INVALID_TYPE" : lua_tostring(L, -1);
+    if (!lua_isnil(L, -1)) {
+        neko_luabind_Pushfunc func = (neko_luabind_Pushfunc)lua_touserdata(L, -1);
+        lua_pop(L, 2);
+        return func(L, type_id, c_in);
+    }
+
     lua_pop(L, 2);
 
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "type_sizes");
-    lua_pushinteger(L, id);
-    lua_gettable(L, -2);
+    // if (neko_luabind_struct_registered_type(L, type_id)) {
+    //     return neko_luabind_struct_push_type(L, type_id, c_in);
+    // }
 
-    typeinfo.size = lua_isnil(L, -1) ? -1 : lua_tointeger(L, -1);
-    lua_pop(L, 2);
+    if (LuaTypeIsEnum(L, type_id)) {
+        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_values");
+        lua_pushinteger(L, type_id);
+        lua_gettable(L, -2);
 
-    return typeinfo;
-}
+        if (!lua_isnil(L, -1)) {
 
-template <>
-inline LuaTypeinfo GetLuaTypeinfo(lua_State *L, const char *name) {
-    return GetLuaTypeinfo(L, TypeFind(L, name));
-}
+            lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
+            lua_pushinteger(L, type_id);
+            lua_gettable(L, -2);
+            size_t size = lua_tointeger(L, -1);
+            lua_pop(L, 2);
 
-template <typename T>
-inline void LuaStructAddType(lua_State *L, LuaTypeid type) {
-    constexpr auto N = reflection::field_count<T>;
+            lua_Integer lvalue = 0;
+            memcpy(&lvalue, c_in, size);
 
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs");
-    lua_pushinteger(L, type);
-    lua_newtable(L);
-    lua_settable(L, -3);
-    lua_pop(L, 1);
+            lua_pushinteger(L, lvalue);
+            lua_gettable(L, -2);
 
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_fields");
-    lua_pushinteger(L, type);
-    lua_newtable(L);
-    lua_settable(L, -3);
-    lua_pop(L, 1);
+            if (!lua_isnil(L, -1)) {
+                lua_getfield(L, -1, "name");
+                lua_remove(L, -2);
+                lua_remove(L, -2);
+                lua_remove(L, -2);
+                return 1;
+            }
+
+            lua_pop(L, 3);
+            lua_pushfstring(L, "LuaTypePush: Enum '%s' value %d not registered!", GetLuaTypeinfo(L, type_id).name, lvalue);
+            lua_error(L);
+            return 0;
+        }
+
+        lua_pop(L, 2);
+        lua_pushfstring(L, "LuaTypePush: Enum '%s' not registered!", GetLuaTypeinfo(L, type_id).name);
+        lua_error(L);
+        return 0;
+    }
 
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_sizes");
-    lua_pushinteger(L, type);
-    lua_pushinteger(L, N);
-    lua_settable(L, -3);
-    lua_pop(L, 1);
+    lua_pushfstring(L, "LuaTypePush: conversion to Lua object from type '%s' not registered!", GetLuaTypeinfo(L, type_id).name);
+    lua_error(L);
+    return 0;
 }
 
-inline void LuaStructAddField(lua_State *L, LuaTypeid type, const char *field_type, const char *field_name) {
+inline void LuaTypeTo(lua_State *L, LuaTypeid type_id, void *c_out, int index) {
 
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs");
-    lua_pushinteger(L, type);
+    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "stack_to");
+    lua_pushinteger(L, type_id);
     lua_gettable(L, -2);
 
     if (!lua_isnil(L, -1)) {
-
-        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_sizes");
-        lua_pushinteger(L, type);
-        lua_gettable(L, -2);
-        size_t size = lua_tointeger(L, -1);
+        neko_luabind_Tofunc func = (neko_luabind_Tofunc)lua_touserdata(L, -1);
         lua_pop(L, 2);
+        func(L, type_id, c_out, index);
+        return;
+    }
 
-        lua_newtable(L);
+    lua_pop(L, 2);
 
-        lua_pushstring(L, field_type);
-        lua_setfield(L, -2, "value");
+    // if (neko_luabind_struct_registered_type(L, type_id)) {
+    //     neko_luabind_struct_to_type(L, type_id, c_out, index);
+    //     return;
+    // }
 
-        lua_pushstring(L, field_name);
-        lua_setfield(L, -2, "name");
+    if (LuaTypeIsEnum(L, type_id)) {
 
-        lua_setfield(L, -2, field_name);
+        const char *name = lua_tostring(L, index);
 
-        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs_fields");
-        lua_pushinteger(L, type);
+        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
+        lua_pushinteger(L, type_id);
         lua_gettable(L, -2);
-        lua_pushstring(L, field_type);
-        lua_getfield(L, -4, field_name);
-        lua_settable(L, -3);
-
-        lua_pop(L, 4);
-        return;
-    }
-
-    lua_pop(L, 2);
-    lua_pushfstring(L, "LuaStructAddValue: Struct '%s' not registered!", GetLuaTypeinfo(L, type).name);
-    lua_error(L);
-}
 
-inline bool LuaTypeIsStruct(lua_State *L, LuaTypeid type) {
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "structs");
-    lua_pushinteger(L, type);
-    lua_gettable(L, -2);
-    bool reg = !lua_isnil(L, -1);
-    lua_pop(L, 2);
-    return reg;
-}
+        if (!lua_isnil(L, -1)) {
 
-template <typename T>
-inline void LuaStructCreate(lua_State *L, const char *fieldName, const char *type_name, size_t type_size, T fieldaccess) {
+            lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
+            lua_pushinteger(L, type_id);
+            lua_gettable(L, -2);
+            size_t size = lua_tointeger(L, -1);
+            lua_pop(L, 2);
 
-    using fieldaccess_func = T;
+            lua_pushstring(L, name);
+            lua_gettable(L, -2);
 
-    if (fieldName) {
-        lua_createtable(L, 0, 0);
-
-        lua_pushinteger(L, type_size);
-        lua_pushstring(L, type_name);
-
-        lua_pushcclosure(
-                L,
-                [](lua_State *L) -> int {
-                    size_t _type_size = lua_tointeger(L, lua_upvalueindex(1));
-                    const char *_type_name = lua_tostring(L, lua_upvalueindex(2));
-                    return LuaStructNew(L, _type_name, _type_size);
-                },
-                2);
-        lua_setfield(L, -2, "new");
-
-        lua_pushstring(L, type_name);
-        lua_pushcclosure(
-                L,
-                [](lua_State *L) -> int {
-                    const char *_type_name = lua_tostring(L, lua_upvalueindex(1));
-                    luaL_getmetatable(L, _type_name);
-
-                    int mt1_idx = lua_absindex(L, -1);
-                    int mt2_idx = lua_absindex(L, 1);
+            if (!lua_isnil(L, -1)) {
+                lua_getfield(L, -1, "value");
+                lua_Integer value = lua_tointeger(L, -1);
+                lua_pop(L, 4);
+                memcpy(c_out, &value, size);
+                return;
+            }
 
-                    lua_pushnil(L);
-                    while (lua_next(L, mt2_idx) != 0) {
-                        const char *key = luaL_checkstring(L, -2);
-                        u64 keyhash = fnv1a(key);
-                        if (keyhash == "__tostring"_hash ||  //
-                            keyhash == "__index"_hash ||     //
-                            keyhash == "__newindex"_hash ||  //
-                            keyhash == "__gc"_hash ||        //
-                            keyhash == "__metatable"_hash) {
-                            lua_pop(L, 1);
-                            printf("metatype with %s is not allow\n", key);
-                            continue;
-                        } else {
-                            lua_pushvalue(L, -2);      // 复制 key
-                            lua_insert(L, -2);         // 交换 key 和 value
-                            lua_settable(L, mt1_idx);  // mt1[key] = value
-                        }
-                    }
-                    return 0;
-                },
-                1);
-        lua_setfield(L, -2, "metatype");
+            lua_pop(L, 3);
+            lua_pushfstring(L, "LuaTypeTo: Enum '%s' field '%s' not registered!", GetLuaTypeinfo(L, type_id).name, name);
+            lua_error(L);
+            return;
+        }
 
-        lua_setfield(L, -2, fieldName);
+        lua_pop(L, 3);
+        lua_pushfstring(L, "LuaTypeTo: Enum '%s' not registered!", GetLuaTypeinfo(L, type_id).name);
+        lua_error(L);
+        return;
     }
 
-    // 创建实例元表
-    luaL_newmetatable(L, type_name);
-
-    lua_pushstring(L, type_name);
-    lua_pushcclosure(
-            L,
-            [](lua_State *L) -> int {
-                const char *_type_name = lua_tostring(L, lua_upvalueindex(1));
-                return LuaStructGC(L, _type_name);
-            },
-            1);
-    lua_setfield(L, -2, "__gc");
+    lua_pushfstring(L, "LuaTypeTo: conversion from Lua object to type '%s' not registered!", GetLuaTypeinfo(L, type_id).name);
+    lua_error(L);
+}
 
-    lua_pushstring(L, type_name);
-    lua_pushcclosure(
-            L,
-            [](lua_State *L) -> int {
-                const char *_type_name = lua_tostring(L, lua_upvalueindex(1));
-                lua_pushstring(L, _type_name);
-                return 1;
-            },
-            1);
-    lua_setfield(L, -2, "__tostring");
+namespace detail {
 
-    lua_pushboolean(L, 0);
-    lua_pushcclosure(L, fieldaccess, 1);
-    lua_setfield(L, -2, "__index");
+// 每个参数的压栈方式在编译期选定 不再查询注册表
+template <typename T>
+inline void PushArg(lua_State *L, T &&v) {
+    using U = std::decay_t<T>;
+    if constexpr (std::is_enum_v<U>) {
+        PushEnum<U>(L, v);
+    } else if constexpr (std::is_array_v<std::remove_reference_t<T>> || !std::is_aggregate_v<U>) {
+        LuaStack::Push(L, std::forward<T>(v));
+    } else if constexpr (is_lua_struct<U>::value) {
+        assert(LuaTypeIsStruct(L, LuaType<U>(L)) && "struct is not registered with LuaStruct");
+        LuaStructPush<U>(L, v);
+    } else {
+        LuaPushRaw<U>(L, v);
+    }
+}
 
-    lua_pushboolean(L, 1);
-    lua_pushcclosure(L, fieldaccess, 1);
-    lua_setfield(L, -2, "__newindex");
+}  // namespace detail
 
-    lua_pop(L, 1);
+// 整个参数包只检查一次栈空间 额外的 4 个槽位留给枚举名缓存等临时值
+template <typename... Args>
+inline void VaradicLuaPush(lua_State *L, Args &&...args) {
+    luaL_checkstack(L, (int)sizeof...(Args) + 4, "VaradicLuaPush: too many arguments");
+    (detail::PushArg(L, std::forward<Args>(args)), ...);
 }
 
-template <typename T, std::size_t I>
-int LuaStructField_w(lua_State *L, const char *typeName, const char *field, int set, T &v) {
-
-    int index = 1;
+namespace detail {
 
-    if constexpr (I < reflection::field_count<T>) {
-        constexpr std::string_view name = reflection::field_name<T, I>;
-        // lua_getfield(L, arg, name.data());
+template <typename R>
+struct LuaResults {
+    static constexpr int count = 1;
 
-        if (name == field) {
-            // printf("LUASTRUCT_FIELD_W %s.%s\n", typeName, field);
-            auto &af = reflection::field_access<I>(v);
-            return LuaStructAccess<reflection::field_type<T, I>>::Get(L, field, &af, index, set, index + 2);
+    static R At(lua_State *L, int idx) {
+        if constexpr (std::is_same_v<R, LuaRef>) {
+            return LuaRef::FromStack(L, idx);
+        } else {
+            return LuaGet<R>(L, idx);
         }
-
-        // reflection::field_access<I>(v) = unpack<reflection::field_type<D, I>>(L, -1);
-        // lua_pop(L, 1);
-        return LuaStructField_w<T, I + 1>(L, typeName, field, set, v);
     }
 
-    return luaL_error(L, "Invalid field %s.%s", typeName, field);
+    static R Pop(lua_State *L) {
+        R r = At(L, -1);
+        lua_pop(L, 1);
+        return r;
+    }
 };
 
-template <typename T>
-void LuaStruct(lua_State *L, const char *fieldName = reflection::GetTypeName<T>()) {
-    static_assert(std::is_standard_layout_v<T>);
-    auto fieldaccess = [](lua_State *L) -> int {
-        int index = 1;
-        int set = lua_toboolean(L, lua_upvalueindex(1));
+template <>
+struct LuaResults<void> {
+    static constexpr int count = 0;
+};
 
-        // printf("fieldaccess %d\n", set);
+template <typename... Ts>
+struct LuaResults<std::tuple<Ts...>> {
+    static constexpr int count = sizeof...(Ts);
+
+    static std::tuple<Ts...> Pop(lua_State *L) {
+        int base = lua_gettop(L) - count;
+        auto r = [&]<std::size_t... I>(std::index_sequence<I...>) {
+            return std::tuple<Ts...>{LuaResults<Ts>::At(L, base + 1 + (int)I)...};
+        }(std::index_sequence_for<Ts...>{});
+        lua_settop(L, base);
+        return r;
+    }
+};
 
-        const char *typeName = reflection::GetTypeName<T>();
-        T *data = LuaStructTodata<T>(L, index);
-        size_t length = 0;
-        const char *field = LuaStructFieldname(L, index + 1, &length);
+}  // namespace detail
 
-        // printf("fieldaccess %s\n", field);
+namespace detail {
 
-        return LuaStructField_w<T, 0>(L, typeName, field, set, *data);
-    };
+// 函数已在栈顶
+template <typename R, typename... Args>
+LuaResult<R> InvokePushed(lua_State *L, Args... args) {
+    VaradicLuaPush(L, args...);
+    const auto size = sizeof...(args);
+    if constexpr (std::is_void_v<R>) {
+        return LuaCall(L, size, 0);
+    } else {
+        int status = luax_xpcall(L, size, detail::LuaResults<R>::count);
+        if (status != LUA_OK) {
+            return LuaPopError(L, status);
+        }
+        return detail::LuaResults<R>::Pop(L);
+    }
+}
 
-    LuaStructCreate(L, fieldName, reflection::GetTypeName<T>(), sizeof(T), fieldaccess);
+}  // namespace detail
 
-    // lua_setglobal(L, fieldName);
+// R 可以是 void 单个值 或 std::tuple<...> 接收多个返回值
+template <typename R, typename... Args>
+LuaResult<R> TryInvokeLua(lua_State *L, const char *name, Args... args) {
+    if (!PushGlobalFunction(L, name)) {
+        return LuaError{LUA_ERRRUN, std::string(name) + " is not a function"};
+    }
+    return detail::InvokePushed<R>(L, args...);
+}
 
-    LuaStructAddType<T>(L, LuaType<T>(L));
+// 通过显式的缓存句柄调用 见 LuaGlobalFunction
+template <typename R, typename... Args>
+LuaResult<R> TryInvokeLua(LuaGlobalFunction &f, Args... args) {
+    if (!f.Push()) {
+        return LuaError{LUA_ERRRUN, f.Name() + " is not a function"};
+    }
+    return detail::InvokePushed<R>(f.State(), args...);
 }
 
-#define neko_lua_enum_has_value(L, type, value)                \
-    const type __neko_lua_enum_value_temp_##value[] = {value}; \
-    neko_lua_enum_has_value_type(L, LuaType<type>(L), __neko_lua_enum_value_temp_##value)
+template <typename R, typename... Args>
+R InvokeLua(lua_State *L, const char *name, Args... args) {
+    auto ret = TryInvokeLua<R>(L, name, args...);
+    if (!ret) {
+        // 与之前一样以 lua_error 向外传播 不抛错的调用使用 TryInvokeLua
+        lua_pushlstring(L, ret.error().msg.data(), ret.error().msg.size());
+        lua_error(L);
+    }
+    if constexpr (!std::is_void_v<R>) {
+        return std::move(*ret);
+    }
+}
 
-template <typename T, typename V>
-    requires std::is_same_v<T, LuaTypeid>
-inline bool LuaEnumHas(lua_State *L, T type, V v) {
-    using VT = std::remove_cv_t<V>;
-    if constexpr (std::is_integral_v<VT>) {
-        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_values");
-        lua_pushinteger(L, type);
-        lua_gettable(L, -2);
-        if (!lua_isnil(L, -1)) {
-            lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
-            lua_pushinteger(L, type);
-            lua_gettable(L, -2);
-            size_t size = lua_tointeger(L, -1);
-            lua_pop(L, 2);
+// 调用 luax_callback_ref 返回的回调句柄
+template <typename R = void, typename... Args>
+LuaResult<R> LuaCallbackCall(lua_State *L, int handle, Args... args) {
+    luaL_checkstack(L, (int)sizeof...(Args) + 2, "LuaCallbackCall: not enough stack slots");
+    (detail::LuaStack::Push(L, args), ...);
+    int status = luax_callback_call(L, handle, sizeof...(Args), detail::LuaResults<R>::count);
+    if (status != LUA_OK) {
+        return LuaPopError(L, status);
+    }
+    if constexpr (std::is_void_v<R>) {
+        return {};
+    } else {
+        return detail::LuaResults<R>::Pop(L);
+    }
+}
 
-            // lua_Integer lvalue = 0;
-            // memcpy(&lvalue, v, size);
+// 以多组参数 (std::tuple 的连续区间) 调用同一个回调 句柄只查找一次
+template <std::ranges::contiguous_range Range>
+LuaResult<void> LuaCallbackBatch(lua_State *L, int handle, const Range &calls) {
+    using Tuple = std::ranges::range_value_t<Range>;
+    if (luax_callback_push(L, handle) != LUA_TFUNCTION) {
+        lua_pop(L, 1);
+        return LuaError{LUA_ERRRUN, "invalid callback handle " + std::to_string(handle)};
+    }
+    LuaResult<void> r = detail::BatchCall<void>(L, -1, std::span<const Tuple>(std::ranges::data(calls), std::ranges::size(calls)), [](size_t) {});
+    lua_pop(L, 1);
+    return r;
+}
 
-            lua_pushinteger(L, v);
-            lua_gettable(L, -2);
+// 从 C++ 逐步驱动一个 Lua 协程 协程线程取自每个 VM 的线程池 结束后归还复用
+// 例: auto t = LuaTask::FromGlobal(L, "ai_behaviour"); while (t && !t->Done()) { auto v = t->Resume<int>(dt); }
+class LuaTask {
+public:
+    LuaTask() = default;
 
-            if (lua_isnil(L, -1)) {
-                lua_pop(L, 3);
-                return false;
-            } else {
-                lua_pop(L, 3);
-                return true;
-            }
+    // 以 index 处的函数作为协程主体
+    static LuaResult<LuaTask> Create(lua_State *L, int index) {
+        if (lua_type(L, index) != LUA_TFUNCTION) {
+            return LuaError{LUA_ERRRUN, "LuaTask: not a function"};
         }
-        lua_pop(L, 2);
-        lua_pushfstring(L, "LuaEnumHas: Enum '%s' not registered!", GetLuaTypeinfo(L, type).name);
-        lua_error(L);
-        return false;
-    } else if constexpr (std::is_same_v<std::decay_t<VT>, char const *>) {
-        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
-        lua_pushinteger(L, type);
-        lua_gettable(L, -2);
-        if (!lua_isnil(L, -1)) {
-            lua_getfield(L, -1, v);
-            if (lua_isnil(L, -1)) {
-                lua_pop(L, 3);
-                return false;
-            } else {
-                lua_pop(L, 3);
-                return true;
-            }
+        index = lua_absindex(L, index);
+        LuaTask task(L);
+        lua_pushvalue(L, index);
+        lua_xmove(L, task.m_co, 1);
+        return task;
+    }
+
+    static LuaResult<LuaTask> FromGlobal(lua_State *L, const char *name) {
+        if (lua_getglobal(L, name) != LUA_TFUNCTION) {
+            lua_pop(L, 1);
+            return LuaError{LUA_ERRRUN, std::string("LuaTask: ") + name + " is not a function"};
         }
-        lua_pop(L, 2);
-        lua_pushfstring(L, "LuaEnumHas: Enum '%s' not registered!", GetLuaTypeinfo(L, type).name);
-        lua_error(L);
-        return false;
-    } else {
-        static_assert(!v, "LuaEnumHas type assert");
+        LuaTask task(L);
+        lua_xmove(L, task.m_co, 1);
+        return task;
+    }
+
+    LuaTask(LuaTask &&other) noexcept : L(other.L), m_co(other.m_co), m_ref(other.m_ref), m_gen(other.m_gen), m_status(other.m_status), m_started(other.m_started) {
+        other.m_co = nullptr;
+        other.m_ref = LUA_NOREF;
+    }
+
+    LuaTask &operator=(LuaTask &&other) noexcept {
+        std::swap(L, other.L);
+        std::swap(m_co, other.m_co);
+        std::swap(m_ref, other.m_ref);
+        std::swap(m_gen, other.m_gen);
+        std::swap(m_status, other.m_status);
+        std::swap(m_started, other.m_started);
+        return *this;
     }
-}
 
-template <typename T, typename V>
-inline bool LuaEnumHas(lua_State *L, V v) {
-    return LuaEnumHas(L, LuaType<T>(L), v);
-}
+    LuaTask(const LuaTask &) = delete;
+    LuaTask &operator=(const LuaTask &) = delete;
 
-inline void LuaEnumAddType(lua_State *L, LuaTypeid type, size_t size) {
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
-    lua_pushinteger(L, type);
-    lua_newtable(L);
-    lua_settable(L, -3);
-    lua_pop(L, 1);
+    ~LuaTask() { Release(); }
 
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_values");
-    lua_pushinteger(L, type);
-    lua_newtable(L);
-    lua_settable(L, -3);
-    lua_pop(L, 1);
+    bool IsValid() const { return m_co != nullptr; }
 
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
-    lua_pushinteger(L, type);
-    lua_pushinteger(L, size);
-    lua_settable(L, -3);
-    lua_pop(L, 1);
-}
+    // 协程已返回或出错
+    bool Done() const { return m_co == nullptr || (m_started && m_status != LUA_YIELD); }
 
-inline void LuaEnumAddValue(lua_State *L, LuaTypeid type, const void *value, const char *name) {
+    lua_State *Thread() const { return m_co; }
 
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
-    lua_pushinteger(L, type);
-    lua_gettable(L, -2);
+    // 恢复协程直到下一次 yield 或返回 R 接收 yield/返回的值 (void / 单值 / std::tuple)
+    template <typename R = void, typename... Args>
+    LuaResult<R> Resume(Args... args) {
+        if (m_co == nullptr || Done()) {
+            return LuaError{LUA_ERRRUN, "cannot resume dead task"};
+        }
+        // m_co 挂起时没有保护 不能在其上抛错
+        if (!lua_checkstack(m_co, (int)sizeof...(Args) + detail::LuaResults<R>::count + 1)) {
+            return LuaError{LUA_ERRMEM, "LuaTask: not enough stack slots"};
+        }
+        (detail::LuaStack::Push(m_co, args), ...);
+        int nres = 0;
+        m_started = true;
+        {
+            detail::BudgetResumeHook scope(L, m_co);
+            m_status = lua_resume(m_co, L, sizeof...(Args), &nres);
+        }
+        if (m_status != LUA_OK && m_status != LUA_YIELD) {
+            luaL_traceback(L, m_co, lua_tostring(m_co, -1), 0);
+            LuaError err = LuaPopError(L, m_status);
+            lua_settop(m_co, 0);
+            return err;
+        }
+        // 多出的值丢弃 不足的补 nil
+        int base = lua_gettop(m_co) - nres;
+        lua_settop(m_co, base + detail::LuaResults<R>::count);
+        if constexpr (std::is_void_v<R>) {
+            return {};
+        } else {
+            R r = detail::LuaResults<R>::Pop(m_co);
+            lua_settop(m_co, base);
+            return r;
+        }
+    }
 
-    if (!lua_isnil(L, -1)) {
+    // co_await task.Next<R>(args...) 与 Resume 相同 只是写法上便于在 C++20 协程中使用
+    // 总是同步执行 不会挂起调用方 Lua 协程等待异步调用时的恢复由 LuaAsyncPoll 完成
+    template <typename R, typename... Args>
+    struct Step {
+        LuaTask &task;
+        std::tuple<Args...> args;
+
+        bool await_ready() const noexcept { return true; }
+        void await_suspend(std::coroutine_handle<>) const noexcept {}
+        LuaResult<R> await_resume() {
+            return std::apply([this](Args &...a) { return task.Resume<R>(a...); }, args);
+        }
+    };
 
-        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
-        lua_pushinteger(L, type);
-        lua_gettable(L, -2);
-        size_t size = lua_tointeger(L, -1);
-        lua_pop(L, 2);
+    template <typename R = void, typename... Args>
+    Step<R, Args...> Next(Args... args) {
+        return {*this, {std::move(args)...}};
+    }
 
-        lua_newtable(L);
+private:
+    explicit LuaTask(lua_State *L) : L(L) { Acquire(); }
+
+    void Acquire() {
+        LuaVMData &vm = GetLuaVMData(L);
+        if (!vm.thread_pool.empty()) {
+            m_ref = vm.thread_pool.back();
+            vm.thread_pool.pop_back();
+            lua_rawgeti(L, LUA_REGISTRYINDEX, m_ref);
+            m_co = lua_tothread(L, -1);
+            lua_pop(L, 1);
+        } else {
+            m_co = lua_newthread(L);
+            m_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+        m_gen = vm.ref_generation;
+        m_status = LUA_OK;
+        m_started = false;
+    }
 
-        lua_Integer lvalue = 0;
-        memcpy(&lvalue, value, size);
+    // 未运行或正常结束的协程可直接复用 出错的先重置
+    // 仍挂起的不复用 它可能还被异步操作 (LuaAwait) 引用
+    bool Reset() {
+        if (m_status == LUA_OK) {
+            lua_settop(m_co, 0);
+            return true;
+        }
+        if (m_status == LUA_YIELD) {
+            return false;
+        }
+#if defined(LUA_VERSION_RELEASE_NUM) && LUA_VERSION_RELEASE_NUM >= 50406
+        return lua_closethread(m_co, L) == LUA_OK;
+#elif defined(LUA_VERSION_RELEASE_NUM) && LUA_VERSION_RELEASE_NUM >= 50404
+        return lua_resetthread(m_co) == LUA_OK;
+#else
+        return false;
+#endif
+    }
 
-        lua_pushinteger(L, lvalue);
-        lua_setfield(L, -2, "value");
+    void Release() {
+        if (m_co == nullptr) {
+            return;
+        }
+        LuaVMData &vm = GetLuaVMData(L);
+        if (m_gen != vm.ref_generation) {
+            // VM 已被 LuaReset 线程的槽位不再属于本任务
+        } else if (Reset() && vm.thread_pool.size() < vm.thread_pool_max) {
+            vm.thread_pool.push_back(m_ref);
+        } else {
+            luaL_unref(L, LUA_REGISTRYINDEX, m_ref);
+        }
+        m_co = nullptr;
+        m_ref = LUA_NOREF;
+    }
 
-        lua_pushstring(L, name);
-        lua_setfield(L, -2, "name");
+    lua_State *L = nullptr;
+    lua_State *m_co = nullptr;
+    int m_ref = LUA_NOREF;
+    u32 m_gen = 0;
+    int m_status = LUA_OK;
+    bool m_started = false;
+};
 
-        lua_setfield(L, -2, name);
+namespace detail {
 
-        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_values");
-        lua_pushinteger(L, type);
-        lua_gettable(L, -2);
-        lua_pushinteger(L, lvalue);
-        lua_getfield(L, -4, name);
-        lua_settable(L, -3);
+// 元表在注册表中的 lightuserdata 键 每个类型一个地址
+template <typename T>
+inline int luaclass_key = 0;
 
-        lua_pop(L, 4);
-        return;
-    }
+// 由 LuaClass 绑定并通过 is_lua_class 声明的非聚合类
+template <typename T>
+concept LuaClassType = is_lua_class<T>::value && std::is_class_v<T> && !std::is_aggregate_v<T>;
 
-    lua_pop(L, 2);
-    lua_pushfstring(L, "LuaEnumAddValue: Enum '%s' not registered!", GetLuaTypeinfo(L, type).name);
-    lua_error(L);
+template <typename T>
+int LuaClassTypeError(lua_State *L, int idx) {
+    const char *name = reflection::name_v<T>.data();
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &luaclass_key<T>) == LUA_TTABLE && lua_getfield(L, -1, "__name") == LUA_TSTRING) {
+        name = lua_tostring(L, -1);
+    }
+    return luaL_typeerror(L, idx, name);
 }
 
-inline bool LuaTypeIsEnum(lua_State *L, LuaTypeid type) {
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
-    lua_pushinteger(L, type);
-    lua_gettable(L, -2);
-    bool reg = !lua_isnil(L, -1);
-    lua_pop(L, 2);
-    return reg;
+// 方法与属性的 self 与闭包上值 1 (元表) 比较 不查注册表
+template <typename T>
+T *LuaClassSelf(lua_State *L) {
+    void *p = lua_touserdata(L, 1);
+    if (p != nullptr && lua_getmetatable(L, 1)) {
+        bool match = lua_rawequal(L, -1, lua_upvalueindex(1));
+        lua_pop(L, 1);
+        if (match) {
+            return udata_align<T>(p);
+        }
+    }
+    LuaClassTypeError<T>(L, 1);
+    return nullptr;
 }
 
-template <typename Enum, int min_value = -64, int max_value = 64>
-void LuaEnum(lua_State *L) {
-    std::map<int, std::string> values;
-    reflection::guess_enum_range<Enum, min_value>(values, std::make_integer_sequence<int, max_value - min_value>());
-    reflection::guess_enum_bit_range<Enum>(values, std::make_integer_sequence<int, 32>());
+}  // namespace detail
 
-    LuaTypeid id = LuaType<Enum>(L);
-    LuaEnumAddType(L, id, sizeof(Enum));
-    for (const auto &value : values) {
-        const Enum enum_value[] = {(Enum)value.first};
-        LuaEnumAddValue(L, id, enum_value, value.second.c_str());
+template <typename T>
+T *LuaClassTest(lua_State *L, int idx) {
+    void *p = lua_touserdata(L, idx);
+    if (p == nullptr || !lua_getmetatable(L, idx)) {
+        return nullptr;
     }
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &detail::luaclass_key<T>);
+    bool match = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return match ? udata_align<T>(p) : nullptr;
 }
 
 template <typename T>
-inline void LuaPush(lua_State *L, T &&v) {
-    detail::LuaStack::Push(L, std::forward<T>(v));
+T *LuaClassCheck(lua_State *L, int idx) {
+    T *p = LuaClassTest<T>(L, idx);
+    if (p == nullptr) {
+        detail::LuaClassTypeError<T>(L, idx);
+    }
+    return p;
 }
 
-template <typename T>
-inline T LuaGet(lua_State *L, int index) {
-    T t{};
-    detail::LuaStack::Get(L, index, t);
-    return t;
+// 在 Lua 中构造一个已由 LuaClass 注册的对象
+template <typename T, typename... Args>
+T &LuaClassNew(lua_State *L, Args &&...args) {
+    T *o = udata_new<T>(L, 0);
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &detail::luaclass_key<T>) != LUA_TTABLE) {
+        luaL_error(L, "class %s is not registered", reflection::name_v<T>.data());
+    }
+    new (o) T(std::forward<Args>(args)...);
+    lua_setmetatable(L, -2);
+    return *o;
 }
 
+namespace detail {
+
 template <typename T>
-    requires std::is_enum_v<T>
-inline void LuaPush(lua_State *L, const T &v) {
-    LuaTypePush(L, LuaType<T>(L), &v);
-}
+struct FunctionTraits;
+
+template <typename R, typename... Args>
+struct FunctionTraits<R (*)(Args...)> {
+    using result = R;
+    using args = std::tuple<Args...>;
+    static constexpr std::size_t arity = sizeof...(Args);
+};
+
+template <typename R, typename... Args>
+struct FunctionTraits<R (*)(Args...) noexcept> : FunctionTraits<R (*)(Args...)> {};
 
 template <typename T>
-    requires std::is_enum_v<T>
-inline auto LuaGet(lua_State *L, int index) -> T {
-    T type_val;
-    LuaTypeTo(L, LuaType<T>(L), &type_val, index);
-    return type_val;
-}
+struct MethodTraits;
 
-template <typename T, std::size_t I>
-void LuaRawStructGet(lua_State *L, int arg, T &v);
+template <typename C, typename R, typename... Args>
+struct MethodTraits<R (C::*)(Args...)> {
+    using result = R;
+    using args = std::tuple<Args...>;
+    static constexpr std::size_t arity = sizeof...(Args);
+};
 
-// template <typename T>
-//     requires std::is_pointer_v<T>
-// T LuaGet(lua_State *L, int arg) {
-//     luaL_checktype(L, arg, LUA_TLIGHTUSERDATA);
-//     return static_cast<T>(lua_touserdata(L, arg));
-// }
+template <typename C, typename R, typename... Args>
+struct MethodTraits<R (C::*)(Args...) const> : MethodTraits<R (C::*)(Args...)> {};
 
-template <>
-inline std::string_view LuaGet<std::string_view>(lua_State *L, int arg) {
-    size_t sz = 0;
-    const char *str = luaL_checklstring(L, arg, &sz);
-    return std::string_view(str, sz);
+template <typename C, typename R, typename... Args>
+struct MethodTraits<R (C::*)(Args...) noexcept> : MethodTraits<R (C::*)(Args...)> {};
+
+template <typename C, typename R, typename... Args>
+struct MethodTraits<R (C::*)(Args...) const noexcept> : MethodTraits<R (C::*)(Args...)> {};
+
+template <typename T>
+concept LuaStructType = is_lua_struct<T>::value;
+
+// 绑定函数的参数转换 每个参数只做一次检查与转换 转换方式在编译期选定
+template <typename P>
+decltype(auto) CheckArg(lua_State *L, int idx) {
+    using T = std::remove_cvref_t<P>;
+    if constexpr (std::is_same_v<T, bool>) {
+        return (bool)lua_toboolean(L, idx);
+    } else if constexpr (std::is_integral_v<T>) {
+        return static_cast<T>(luaL_checkinteger(L, idx));
+    } else if constexpr (std::is_floating_point_v<T>) {
+        return static_cast<T>(luaL_checknumber(L, idx));
+    } else if constexpr (std::is_same_v<T, const char *>) {
+        return luaL_checkstring(L, idx);
+    } else if constexpr (std::is_same_v<T, std::string_view>) {
+        return checkstrview(L, idx);
+    } else if constexpr (std::is_same_v<T, std::string>) {
+        size_t len = 0;
+        const char *str = luaL_checklstring(L, idx, &len);
+        return std::string(str, len);
+    } else if constexpr (std::is_enum_v<T>) {
+        if (lua_type(L, idx) == LUA_TNUMBER) {
+            return static_cast<T>(lua_tointeger(L, idx));
+        }
+        return LuaGet<T>(L, idx);  // 按枚举名转换
+    } else if constexpr (std::is_pointer_v<T> && LuaStructType<std::remove_cv_t<std::remove_pointer_t<T>>>) {
+        return LuaStructTodata<std::remove_cv_t<std::remove_pointer_t<T>>>(L, idx);
+    } else if constexpr (std::is_pointer_v<T> && LuaClassType<std::remove_cv_t<std::remove_pointer_t<T>>>) {
+        return LuaClassCheck<std::remove_cv_t<std::remove_pointer_t<T>>>(L, idx);
+    } else if constexpr (std::is_pointer_v<T>) {
+        return static_cast<T>(lua_touserdata(L, idx));
+    } else if constexpr (LuaStructType<T>) {
+        return *LuaStructTodata<T>(L, idx);  // 引用参数直接指向 userdata 中的数据
+    } else if constexpr (LuaClassType<T>) {
+        return *LuaClassCheck<T>(L, idx);
+    } else {
+        return LuaGet<T>(L, idx);
+    }
 }
 
-template <template <typename...> class Template, typename Class>
-struct is_instantiation : std::false_type {};
-template <template <typename...> class Template, typename... Args>
-struct is_instantiation<Template, Template<Args...>> : std::true_type {};
-template <typename Class, template <typename...> class Template>
-concept is_instantiation_of = is_instantiation<Template, Class>::value;
+// 不抛出 Lua 错误的参数检查 与 CheckArg 接受的值一致
+template <typename P>
+bool ArgOk(lua_State *L, int idx) {
+    using T = std::remove_cvref_t<P>;
+    using U = std::remove_cv_t<std::remove_pointer_t<T>>;
+    if constexpr (std::is_same_v<T, bool>) {
+        return true;
+    } else if constexpr (std::is_integral_v<T>) {
+        int isnum = 0;
+        lua_tointegerx(L, idx, &isnum);
+        return isnum;
+    } else if constexpr (std::is_floating_point_v<T>) {
+        return lua_isnumber(L, idx);
+    } else if constexpr (std::is_same_v<T, const char *> || std::is_same_v<T, std::string_view> || std::is_same_v<T, std::string>) {
+        return lua_isstring(L, idx);
+    } else if constexpr (std::is_enum_v<T>) {
+        if (lua_type(L, idx) == LUA_TNUMBER) {
+            return true;
+        }
+        if (lua_type(L, idx) != LUA_TSTRING) {
+            return false;
+        }
+        // 未知的枚举名会让 CheckArg 中的 LuaGet 抛错 这里先确认名字已注册
+        bool ok = false;
+        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
+        lua_pushinteger(L, LuaType<T>(L));
+        if (lua_gettable(L, -2) == LUA_TTABLE) {
+            lua_pushvalue(L, idx);
+            ok = lua_rawget(L, -2) != LUA_TNIL;
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 2);
+        return ok;
+    } else if constexpr (std::is_pointer_v<T> && LuaStructType<U>) {
+        return LuaStructIs<U>(L, idx);
+    } else if constexpr (std::is_pointer_v<T> && LuaClassType<U>) {
+        return LuaClassTest<U>(L, idx) != nullptr;
+    } else if constexpr (LuaStructType<T>) {
+        return LuaStructIs<T>(L, idx);
+    } else if constexpr (LuaClassType<T>) {
+        return LuaClassTest<T>(L, idx) != nullptr;
+    } else {
+        return true;
+    }
+}
+
+// 从 first 开始校验参数列表 Args (std::tuple) 通过时返回 0 否则返回出错的栈索引
+template <typename Args>
+int ArgsCheck(lua_State *L, int first) {
+    return [L, first]<std::size_t... I>(std::index_sequence<I...>) {
+        int bad = 0;
+        (void)((ArgOk<std::tuple_element_t<I, Args>>(L, first + (int)I) || (bad = first + (int)I, false)) && ...);
+        return bad;
+    }(std::make_index_sequence<std::tuple_size_v<Args>>{});
+}
+
+inline int ArgFail(lua_State *L, int idx) { return LuaFail(L, "bad argument #%d (got %s)", idx, luaL_typename(L, idx)); }
 
 template <typename T>
-    requires is_instantiation_of<T, std::map>
-T LuaGet(lua_State *L, int arg) {
-    arg = lua_absindex(L, arg);
-    luaL_checktype(L, arg, LUA_TTABLE);
-    T v;
-    lua_pushnil(L);
-    while (lua_next(L, arg)) {
-        auto key = LuaGet<typename T::key_type>(L, -2);
-        auto mapped = LuaGet<typename T::mapped_type>(L, -1);
-        v.emplace(std::move(key), std::move(mapped));
-        lua_pop(L, 1);
+void PushValue(lua_State *L, const T &v) {
+    if constexpr (std::is_enum_v<T>) {
+        LuaPush<T>(L, v);
+    } else if constexpr (LuaStructType<T> && !is_instantiation_of<T, std::tuple>) {
+        LuaStructPush<T>(L, v);
+    } else if constexpr (LuaClassType<T>) {
+        LuaClassNew<T>(L, v);
+    } else {
+        LuaStack::Push(L, v);
     }
-    return v;
 }
 
 template <typename T>
-    requires is_instantiation_of<T, std::vector>
-T LuaGet(lua_State *L, int arg) {
-    arg = lua_absindex(L, arg);
-    luaL_checktype(L, arg, LUA_TTABLE);
-    lua_Integer n = luaL_len(L, arg);
-    T v;
-    v.reserve((size_t)n);
-    for (lua_Integer i = 1; i <= n; ++i) {
-        lua_geti(L, arg, i);
-        auto value = LuaGet<typename T::value_type>(L, -1);
-        v.emplace_back(std::move(value));
-        lua_pop(L, 1);
+struct is_lua_future : std::false_type {};
+
+template <typename T>
+struct is_lua_future<LuaFuture<T>> : std::true_type {};
+
+template <typename R>
+int LuaAwait(lua_State *L, const LuaFuture<R> &f);
+
+template <typename T>
+struct is_lua_result : std::false_type {};
+
+template <typename T>
+struct is_lua_result<LuaResult<T>> : std::true_type {};
+
+// 压入返回值 std::tuple 展开为多个返回值
+// LuaResult 携带错误时压入错误信息并返回负值 由 Wrap 抛出
+template <typename T>
+int PushResult(lua_State *L, const T &v) {
+    if constexpr (is_lua_future<T>::value) {
+        return LuaAwait(L, v);
+    } else if constexpr (is_lua_result<T>::value) {
+        if (!v) {
+            return LuaFail(L, "%s", v.error().msg.c_str());
+        }
+        if constexpr (std::is_same_v<T, LuaResult<void>>) {
+            return 0;
+        } else {
+            return PushResult<std::remove_cvref_t<decltype(*v)>>(L, *v);
+        }
+    } else if constexpr (is_instantiation_of<T, std::tuple>) {
+        luaL_checkstack(L, (int)std::tuple_size_v<T>, "too many results");
+        std::apply([L](const auto &...e) { (PushValue(L, e), ...); }, v);
+        return (int)std::tuple_size_v<T>;
+    } else {
+        PushValue(L, v);
+        return 1;
     }
-    return v;
 }
 
-template <typename T, std::size_t I>
-void LuaRawStructGet(lua_State *L, int arg, T &v) {
-    if constexpr (I < reflection::field_count<T>) {
-        constexpr auto name = reflection::field_name<T, I>;
-        lua_getfield(L, arg, name.data());
-        reflection::field_access<I>(v) = LuaGet<reflection::field_type<T, I>>(L, -1);
-        lua_pop(L, 1);
-        LuaRawStructGet<T, I + 1>(L, arg, v);
+// 以 first 起的栈参数调用 fn 并压入返回值 Traits 提供 result/args/arity
+// 签名为 int(lua_State *) 的函数按 lua_CFunction 直接调用
+template <typename Traits, typename Fn>
+int CallBound(lua_State *L, int first, Fn &&fn) {
+    using R = typename Traits::result;
+    if constexpr (std::is_same_v<typename Traits::args, std::tuple<lua_State *>>) {
+        static_assert(std::is_same_v<R, int>, "raw lua functions must return int");
+        return fn(L);
+    } else {
+        // 两种错误策略下都先统一校验 转换中途不会因 luaL_check* 跳过已构造的参数
+        if (int bad = ArgsCheck<typename Traits::args>(L, first)) {
+            return ArgFail(L, bad);
+        }
+        return [L, first, &fn]<std::size_t... I>(std::index_sequence<I...>) -> int {
+            if constexpr (std::is_void_v<R>) {
+                fn(CheckArg<std::tuple_element_t<I, typename Traits::args>>(L, first + (int)I)...);
+                return 0;
+            } else {
+                R r = fn(CheckArg<std::tuple_element_t<I, typename Traits::args>>(L, first + (int)I)...);
+                return PushResult<std::remove_cvref_t<R>>(L, r);
+            }
+        }(std::make_index_sequence<Traits::arity>{});
     }
 }
 
-template <typename T, std::size_t I>
-void LuaRawStructPush(lua_State *L, const T &v);
+template <auto F>
+int BindThunk(lua_State *L) {
+    return CallBound<FunctionTraits<decltype(F)>>(L, 1, [](auto &&...a) -> decltype(auto) { return F(std::forward<decltype(a)>(a)...); });
+}
 
-template <typename T, std::size_t I>
-void LuaRawStructPush(lua_State *L, const T &v) {
-    if constexpr (I < reflection::field_count<T>) {
-        constexpr auto name = reflection::field_name<T, I>;
-        using FT = reflection::field_type<T, I>;
-        LuaPush(L, reflection::field_access<I>(v));
-        lua_setfield(L, -2, name.data());
-        LuaRawStructPush<T, I + 1>(L, v);
+// 已完成的异步状态转换为恢复值 (true, 结果...) 或 (false, 错误信息)
+template <typename R>
+int PushSettled(lua_State *L, LuaAsyncState<R> &s) {
+    std::lock_guard lock(s.mutex);
+    if (!s.value) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, s.error.c_str());
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    if constexpr (std::is_void_v<R>) {
+        return 1;
+    } else {
+        return 1 + PushResult<R>(L, *s.value);
+    }
+}
+
+// 返回 LuaFuture 的绑定函数在协程中调用时挂起该协程 完成后由 LuaAsyncPoll 恢复
+// 已完成的 future 直接返回结果 不挂起
+template <typename R>
+int LuaAwait(lua_State *L, const LuaFuture<R> &f) {
+    auto state = f.State();
+    if (!state) {
+        return LuaFail(L, "invalid future");
     }
+    if (f.Ready()) {
+        int n = PushSettled(L, *state);
+        if (!lua_toboolean(L, -n)) {
+            return NEKOLUA_BIND_ERROR;  // 错误信息已在栈顶
+        }
+        lua_remove(L, -n);
+        return n - 1;
+    }
+    if (!lua_isyieldable(L)) {
+        return LuaFail(L, "async function must be called from a coroutine");
+    }
+    LuaVMData &vm = GetLuaVMData(L);
+    lua_pushthread(L);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ++vm.async_pending;
+    std::weak_ptr<LuaAsyncQueue> queue = vm.async;
+    state->Then([queue, ref, state]() {
+        if (auto q = queue.lock()) {
+            q->Push({ref, [state](lua_State *co) { return PushSettled(co, *state); }});
+        }
+    });
+    return NEKOLUA_BIND_YIELD;
 }
 
+// 闭包状态的元表 (只含 __gc) 在注册表中的键
 template <typename T>
-    requires(std::is_aggregate_v<T>)
-inline void LuaPush(lua_State *L, const T &v) {
-    bool is_reg_struct = LuaTypeIsStruct(L, LuaType<T>(L));
-    if (is_reg_struct) {
-        LuaStructPush<T>(L, v);
-    } else {  // 未经过注册的聚合类
-        assert(!"use LuaPushRaw");
+inline int closure_key = 0;
+
+// 在栈顶创建保存 v 的 userdata 仅在需要析构时设置带 __gc 的元表
+template <typename T>
+void PushClosureData(lua_State *L, T &&v) {
+    using U = std::decay_t<T>;
+    U *o = udata_new<U>(L, 0);
+    if constexpr (std::is_trivially_destructible_v<U>) {
+        new (o) U(std::forward<T>(v));
+    } else {
+        if (lua_rawgetp(L, LUA_REGISTRYINDEX, &closure_key<U>) != LUA_TTABLE) {
+            lua_pop(L, 1);
+            lua_createtable(L, 0, 1);
+            lua_pushcfunction(L, destroyudata<U>);
+            lua_setfield(L, -2, "__gc");
+            lua_pushvalue(L, -1);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, &closure_key<U>);
+        }
+        new (o) U(std::forward<T>(v));
+        lua_setmetatable(L, -2);
     }
 }
 
-template <typename T>
-    requires std::is_aggregate_v<T>
-void LuaPushRaw(lua_State *L, const T &v) {
-    lua_createtable(L, 0, (int)reflection::field_count<T>);
-    LuaRawStructPush<T, 0>(L, v);
-    return;
+template <typename F>
+using CallableTraits = MethodTraits<decltype(&F::operator())>;
+
+// 状态在上值 1 的 userdata 中 每次调用只取一次上值
+template <typename F>
+int ClosureThunk(lua_State *L) {
+    F &f = *udata_align<F>(lua_touserdata(L, lua_upvalueindex(1)));
+    return CallBound<CallableTraits<F>>(L, 1, [&f](auto &&...a) -> decltype(auto) { return f(std::forward<decltype(a)>(a)...); });
 }
 
-template <typename T>
-    requires std::is_aggregate_v<T>
-T LuaGetRaw(lua_State *L, int arg) {
-    T v;
-    LuaRawStructGet<T, 0>(L, arg, v);
-    return v;
+// 无捕获的 lambda 不需要上值
+template <typename F>
+int EmptyClosureThunk(lua_State *L) {
+    F f{};
+    return CallBound<CallableTraits<F>>(L, 1, [&f](auto &&...a) -> decltype(auto) { return f(std::forward<decltype(a)>(a)...); });
 }
 
-template <typename T>
-    requires(is_struct<T>::value)
-inline auto LuaGet(lua_State *L, int index) {
-    bool is_reg_struct = LuaTypeIsStruct(L, LuaType<T>(L));
-    T *v{};
-    if (is_reg_struct) {
-        v = LuaStructTodata<T>(L, index);
-    } else {  // 未经过注册的聚合类
-        assert(!"use LuaGetRaw");
+template <typename C, typename M>
+struct BoundMember {
+    C *obj;
+    M method;
+};
+
+template <typename C, typename M>
+int MemberThunk(lua_State *L) {
+    auto &b = *udata_align<BoundMember<C, M>>(lua_touserdata(L, lua_upvalueindex(1)));
+    return CallBound<MethodTraits<M>>(L, 1, [&b](auto &&...a) -> decltype(auto) { return (b.obj->*b.method)(std::forward<decltype(a)>(a)...); });
+}
+
+// 参数期望的 lua_type LUA_TNONE 表示接受任意类型
+template <typename P>
+constexpr int ArgLuaType() {
+    using T = std::remove_cvref_t<P>;
+    if constexpr (std::is_same_v<T, bool>) {
+        return LUA_TBOOLEAN;
+    } else if constexpr (std::is_arithmetic_v<T>) {
+        return LUA_TNUMBER;
+    } else if constexpr (std::is_same_v<T, const char *> || std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>) {
+        return LUA_TSTRING;
+    } else if constexpr (LuaStructType<T> || (std::is_pointer_v<T> && LuaStructType<std::remove_cv_t<std::remove_pointer_t<T>>>)) {
+        return LUA_TUSERDATA;
+    } else if constexpr (LuaClassType<T> || (std::is_pointer_v<T> && LuaClassType<std::remove_cv_t<std::remove_pointer_t<T>>>)) {
+        return LUA_TUSERDATA;
+    } else if constexpr (std::is_pointer_v<T>) {
+        return LUA_TLIGHTUSERDATA;
+    } else if constexpr (is_instantiation_of<T, std::vector> || is_instantiation_of<T, std::map>) {
+        return LUA_TTABLE;
+    } else {
+        return LUA_TNONE;  // 枚举可以是名字或数值
     }
-    return v;
 }
 
-inline int LuaTypePush(lua_State *L, LuaTypeid type_id, const void *c_in) {
+// 重载的类型签名 每个参数占 4 位 (lua_type + 1) mask 中任意类型的位置为 0
+template <auto F>
+struct OverloadSig {
+    using Traits = FunctionTraits<decltype(F)>;
+    static constexpr int arity = (int)Traits::arity;
+    static_assert(arity <= 16, "overloaded functions support at most 16 arguments");
 
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "stack_push");
-    lua_pushinteger(L, type_id);
-    lua_gettable(L, -2);
+    static constexpr u64 sig = []<std::size_t... I>(std::index_sequence<I...>) {
+        return (u64{0} | ... | ((u64)(ArgLuaType<std::tuple_element_t<I, typename Traits::args>>() + 1) << (4 * I)));
+    }(std::make_index_sequence<Traits::arity>{});
 
-    if (!lua_isnil(L, -1)) {
-        neko_luabind_Pushfunc func = (neko_luabind_Pushfunc)lua_touserdata(L, -1);
-        lua_pop(L, 2);
-        return func(L, type_id, c_in);
+    static constexpr u64 mask = []<std::size_t... I>(std::index_sequence<I...>) {
+        return (u64{0} | ... | ((ArgLuaType<std::tuple_element_t<I, typename Traits::args>>() == LUA_TNONE ? u64{0} : u64{0xF}) << (4 * I)));
+    }(std::make_index_sequence<Traits::arity>{});
+};
+
+// 同一签名下存在多个候选时 (例如不同的结构体) 才需要比较元表
+template <auto F, auto... Fs>
+constexpr bool OverloadAmbiguous = ((OverloadSig<F>::arity == OverloadSig<Fs>::arity && OverloadSig<F>::sig == OverloadSig<Fs>::sig) + ...) > 1;
+
+template <auto F, bool Ambiguous>
+bool OverloadStructMatch(lua_State *L) {
+    if constexpr (!Ambiguous) {
+        return true;
+    } else {
+        using Traits = FunctionTraits<decltype(F)>;
+        return [L]<std::size_t... I>(std::index_sequence<I...>) {
+            auto match = [L]<typename P>(int idx) -> bool {
+                using T = std::remove_cv_t<std::remove_pointer_t<std::remove_cvref_t<P>>>;
+                if constexpr (LuaClassType<T>) {
+                    return LuaClassTest<T>(L, idx) != nullptr;
+                } else if constexpr (ArgLuaType<P>() == LUA_TUSERDATA) {
+                    return LuaStructIs<T>(L, idx);
+                } else {
+                    return true;
+                }
+            };
+            return (match.template operator()<std::tuple_element_t<I, typename Traits::args>>((int)I + 1) && ...);
+        }(std::make_index_sequence<Traits::arity>{});
     }
+}
 
-    lua_pop(L, 2);
+template <auto... Fs>
+int OverloadThunk(lua_State *L) {
+    const int n = lua_gettop(L);
+    u64 actual = 0;
+    for (int i = 0; i < n && i < 16; ++i) {
+        actual |= (u64)(lua_type(L, i + 1) + 1) << (4 * i);
+    }
+    // 按声明顺序取第一个 arity 与签名都匹配的候选
+    int result = 0;
+    bool found = ((OverloadSig<Fs>::arity == n && (actual & OverloadSig<Fs>::mask) == OverloadSig<Fs>::sig &&
+                   OverloadStructMatch<Fs, OverloadAmbiguous<Fs, Fs...>>(L) && (result = BindThunk<Fs>(L), true)) ||
+                  ...);
+    if (!found) {
+        return luaL_error(L, "no matching overload for %d arguments", n);
+    }
+    return result;
+}
 
-    // if (neko_luabind_struct_registered_type(L, type_id)) {
-    //     return neko_luabind_struct_push_type(L, type_id, c_in);
-    // }
+}  // namespace detail
 
-    if (LuaTypeIsEnum(L, type_id)) {
-        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_values");
-        lua_pushinteger(L, type_id);
-        lua_gettable(L, -2);
+// 由 C++ 函数签名生成 lua_CFunction
+// 例: lua_register(L, "add", Bind<&add>());
+template <auto F>
+lua_CFunction Bind() {
+    return Wrap<detail::BindThunk<F>>;
+}
 
-        if (!lua_isnil(L, -1)) {
+// 压入带状态的 lambda 或函数对象 状态内联存放在闭包上值的 userdata 中
+// 只有非平凡析构的状态才设置 __gc 无捕获的 lambda 压入为普通 C 函数
+// 例: int hits = 0; LuaPushClosure(L, [&hits](int n) { hits += n; }); lua_setglobal(L, "hit");
+template <typename F>
+void LuaPushClosure(lua_State *L, F &&f) {
+    using U = std::decay_t<F>;
+    static_assert(requires { &U::operator(); }, "generic lambdas and overloaded functors cannot be bound");
+    if constexpr (std::is_empty_v<U> && std::is_default_constructible_v<U>) {
+        lua_pushcfunction(L, Wrap<detail::EmptyClosureThunk<U>>);
+    } else {
+        detail::PushClosureData(L, std::forward<F>(f));
+        lua_pushcclosure(L, Wrap<detail::ClosureThunk<U>>, 1);
+    }
+}
 
-            lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
-            lua_pushinteger(L, type_id);
-            lua_gettable(L, -2);
-            size_t size = lua_tointeger(L, -1);
-            lua_pop(L, 2);
+// 压入绑定到对象的成员函数 obj 的生命周期由 C++ 侧保证
+// 例: LuaPushClosure(L, &player, &Player::Damage); lua_setglobal(L, "damage");
+template <typename C, typename M>
+    requires std::is_member_function_pointer_v<M>
+void LuaPushClosure(lua_State *L, C *obj, M method) {
+    detail::PushClosureData(L, detail::BoundMember<C, M>{obj, method});
+    lua_pushcclosure(L, Wrap<detail::MemberThunk<C, M>>, 1);
+}
 
-            lua_Integer lvalue = 0;
-            memcpy(&lvalue, c_in, size);
+// 多个重载注册为同一个 Lua 函数 先按参数个数 再按 lua_type 签名选择
+// 同为 number 的参数 (如 int 与 double) 无法区分 按声明顺序取第一个
+template <auto... Fs>
+lua_CFunction BindOverloads() {
+    static_assert(sizeof...(Fs) > 0);
+    return Wrap<detail::OverloadThunk<Fs...>>;
+}
 
-            lua_pushinteger(L, lvalue);
-            lua_gettable(L, -2);
+namespace detail {
 
-            if (!lua_isnil(L, -1)) {
-                lua_getfield(L, -1, "name");
-                lua_remove(L, -2);
-                lua_remove(L, -2);
-                lua_remove(L, -2);
-                return 1;
-            }
+template <typename T, typename... Args>
+int LuaClassCtor(lua_State *L) {
+    if (int bad = ArgsCheck<std::tuple<Args...>>(L, 1)) {
+        return ArgFail(L, bad);
+    }
+    [L]<std::size_t... I>(std::index_sequence<I...>) {
+        T *o = udata_new<T>(L, 0);
+        new (o) T(CheckArg<Args>(L, (int)I + 1)...);
+    }(std::index_sequence_for<Args...>{});
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_setmetatable(L, -2);
+    return 1;
+}
 
-            lua_pop(L, 3);
-            lua_pushfstring(L, "LuaTypePush: Enum '%s' value %d not registered!", GetLuaTypeinfo(L, type_id).name, lvalue);
-            lua_error(L);
-            return 0;
-        }
+// 方法参数从 2 开始 1 为 self
+template <typename T, auto M>
+int LuaClassMethod(lua_State *L) {
+    T *self = LuaClassSelf<T>(L);
+    return CallBound<MethodTraits<decltype(M)>>(L, 2, [self](auto &&...a) -> decltype(auto) { return (self->*M)(std::forward<decltype(a)>(a)...); });
+}
 
-        lua_pop(L, 2);
-        lua_pushfstring(L, "LuaTypePush: Enum '%s' not registered!", GetLuaTypeinfo(L, type_id).name);
-        lua_error(L);
-        return 0;
+// 属性读写函数由 __index/__newindex 直接调用 栈为 (self, key[, value])
+template <typename T, auto G>
+int LuaClassGetter(lua_State *L) {
+    T *self = LuaClassSelf<T>(L);
+    if constexpr (std::is_member_object_pointer_v<decltype(G)>) {
+        return PushResult<std::remove_cvref_t<decltype(self->*G)>>(L, self->*G);
+    } else {
+        using R = typename MethodTraits<decltype(G)>::result;
+        R r = (self->*G)();
+        return PushResult<std::remove_cvref_t<R>>(L, r);
     }
+}
 
-    lua_pushfstring(L, "LuaTypePush: conversion to Lua object from type '%s' not registered!", GetLuaTypeinfo(L, type_id).name);
-    lua_error(L);
+template <typename T, auto S>
+int LuaClassSetter(lua_State *L) {
+    T *self = LuaClassSelf<T>(L);
+    if constexpr (std::is_member_object_pointer_v<decltype(S)>) {
+        using V = std::remove_reference_t<decltype(self->*S)>;
+        if (!ArgOk<V>(L, 3)) {
+            return ArgFail(L, 3);
+        }
+        self->*S = CheckArg<V>(L, 3);
+    } else {
+        using V = std::tuple_element_t<0, typename MethodTraits<decltype(S)>::args>;
+        if (!ArgOk<V>(L, 3)) {
+            return ArgFail(L, 3);
+        }
+        (self->*S)(CheckArg<V>(L, 3));
+    }
     return 0;
 }
 
-inline void LuaTypeTo(lua_State *L, LuaTypeid type_id, void *c_out, int index) {
+// 上值 1 为元表 (供读函数中的 LuaClassSelf 比较) 上值 2 为方法表 上值 3 为属性读函数表
+inline int LuaClassIndex(lua_State *L) {
+    lua_settop(L, 2);
+    lua_pushvalue(L, 2);
+    if (lua_rawget(L, lua_upvalueindex(2)) != LUA_TNIL) {
+        return 1;
+    }
+    lua_pushvalue(L, 2);
+    if (lua_rawget(L, lua_upvalueindex(3)) == LUA_TFUNCTION) {
+        lua_CFunction get = lua_tocfunction(L, -1);
+        lua_settop(L, 2);
+        return get(L);
+    }
+    lua_pushnil(L);
+    return 1;
+}
 
-    lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "stack_to");
-    lua_pushinteger(L, type_id);
-    lua_gettable(L, -2);
+// 上值 1 为元表 上值 2 为属性写函数表
+inline int LuaClassNewIndex(lua_State *L) {
+    lua_settop(L, 3);
+    lua_pushvalue(L, 2);
+    if (lua_rawget(L, lua_upvalueindex(2)) == LUA_TFUNCTION) {
+        lua_CFunction set = lua_tocfunction(L, -1);
+        lua_settop(L, 3);
+        return set(L);
+    }
+    return luaL_error(L, "cannot set field '%s'", luaL_tolstring(L, 2, nullptr));
+}
 
-    if (!lua_isnil(L, -1)) {
-        neko_luabind_Tofunc func = (neko_luabind_Tofunc)lua_touserdata(L, -1);
-        lua_pop(L, 2);
-        func(L, type_id, c_out, index);
-        return;
+}  // namespace detail
+
+// 非聚合类的绑定 实例是完整 userdata 方法存放在独立的方法表中
+// 没有属性时 __index 就是方法表 方法查找只是一次表访问 元表 (含 __gc) 不暴露给脚本
+// 与 LuaStruct 相同 类表 (new 与静态函数) 在析构时放入调用前栈顶的表
+// 例: LuaClass<Sprite>(L, "Sprite").Constructor<int, int>().Method<&Sprite::Draw>("Draw").Property<&Sprite::GetX, &Sprite::SetX>("x");
+template <typename T>
+class LuaClass {
+public:
+    LuaClass(lua_State *L, const char *name) : L(L), m_name(name) {
+        lua_createtable(L, 0, 2);
+        m_cls = lua_gettop(L);
+        luaL_newmetatable(L, name);
+        m_mt = lua_gettop(L);
+        lua_pushvalue(L, m_mt);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &detail::luaclass_key<T>);
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            lua_pushcfunction(L, destroyudata<T>);
+            lua_setfield(L, m_mt, "__gc");
+        }
+        lua_pushboolean(L, 0);
+        lua_setfield(L, m_mt, "__metatable");  // getmetatable(obj) 只得到 false
+        lua_newtable(L);
+        m_methods = lua_gettop(L);
+        lua_newtable(L);
+        m_getters = lua_gettop(L);
+        lua_newtable(L);
+        m_setters = lua_gettop(L);
     }
 
-    lua_pop(L, 2);
+    LuaClass(const LuaClass &) = delete;
+    LuaClass &operator=(const LuaClass &) = delete;
 
-    // if (neko_luabind_struct_registered_type(L, type_id)) {
-    //     neko_luabind_struct_to_type(L, type_id, c_out, index);
-    //     return;
-    // }
+    ~LuaClass() {
+        if (m_has_getters) {
+            lua_pushvalue(L, m_mt);
+            lua_pushvalue(L, m_methods);
+            lua_pushvalue(L, m_getters);
+            lua_pushcclosure(L, detail::LuaClassIndex, 3);
+        } else {
+            lua_pushvalue(L, m_methods);
+        }
+        lua_setfield(L, m_mt, "__index");
+        if (m_has_setters) {
+            lua_pushvalue(L, m_mt);
+            lua_pushvalue(L, m_setters);
+            lua_pushcclosure(L, detail::LuaClassNewIndex, 2);
+            lua_setfield(L, m_mt, "__newindex");
+        }
+        lua_settop(L, m_cls);
+        lua_setfield(L, -2, m_name);
+    }
 
-    if (LuaTypeIsEnum(L, type_id)) {
+    // Lua 侧为 Name.new(...)
+    template <typename... Args>
+    LuaClass &Constructor() {
+        static_assert(std::is_constructible_v<T, Args...>);
+        lua_pushvalue(L, m_mt);
+        lua_pushcclosure(L, Wrap<detail::LuaClassCtor<T, Args...>>, 1);
+        lua_setfield(L, m_cls, "new");
+        return *this;
+    }
 
-        const char *name = lua_tostring(L, index);
+    template <auto M>
+    LuaClass &Method(const char *name) {
+        static_assert(std::is_member_function_pointer_v<decltype(M)>);
+        lua_pushvalue(L, m_mt);
+        lua_pushcclosure(L, Wrap<detail::LuaClassMethod<T, M>>, 1);
+        lua_setfield(L, m_methods, name);
+        return *this;
+    }
 
-        lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums");
-        lua_pushinteger(L, type_id);
-        lua_gettable(L, -2);
+    // G 为数据成员指针或无参 getter; S 为单参 setter 省略时数据成员可写 getter 只读
+    template <auto G, auto S = nullptr>
+    LuaClass &Property(const char *name) {
+        lua_pushcfunction(L, (Wrap<detail::LuaClassGetter<T, G>>));
+        lua_setfield(L, m_getters, name);
+        m_has_getters = true;
+        if constexpr (!std::is_null_pointer_v<decltype(S)>) {
+            lua_pushcfunction(L, (Wrap<detail::LuaClassSetter<T, S>>));
+            lua_setfield(L, m_setters, name);
+            m_has_setters = true;
+        } else if constexpr (std::is_member_object_pointer_v<decltype(G)>) {
+            if constexpr (!std::is_const_v<std::remove_reference_t<decltype(std::declval<T &>().*G)>>) {
+                lua_pushcfunction(L, (Wrap<detail::LuaClassSetter<T, G>>));
+                lua_setfield(L, m_setters, name);
+                m_has_setters = true;
+            }
+        }
+        return *this;
+    }
 
-        if (!lua_isnil(L, -1)) {
+    template <auto F>
+    LuaClass &StaticFunction(const char *name) {
+        if constexpr (std::is_same_v<decltype(F), lua_CFunction>) {
+            lua_pushcfunction(L, Wrap<F>);
+        } else {
+            lua_pushcfunction(L, Bind<F>());
+        }
+        lua_setfield(L, m_cls, name);
+        return *this;
+    }
 
-            lua_getfield(L, LUA_REGISTRYINDEX, NEKO_LUA_AUTO_REGISTER_PREFIX "enums_sizes");
-            lua_pushinteger(L, type_id);
-            lua_gettable(L, -2);
-            size_t size = lua_tointeger(L, -1);
-            lua_pop(L, 2);
+private:
+    lua_State *L;
+    const char *m_name;
+    int m_cls;
+    int m_mt;
+    int m_methods;
+    int m_getters;
+    int m_setters;
+    bool m_has_getters = false;
+    bool m_has_setters = false;
+};
 
-            lua_pushstring(L, name);
-            lua_gettable(L, -2);
+// 类型化的事件队列 Emit 只是 vector 追加
+// 分发时每个订阅者调用一次 fn(batch, n) batch 是每个通道复用的表 只在回调期间有效 应遍历 1..n
+// 已注册的 LuaStruct 事件复用表中上次的 userdata 原地覆盖 不再为每个事件分配
+template <typename E>
+class LuaEventQueue final : public LuaEventQueueBase {
+public:
+    static inline const char tag = 0;
 
-            if (!lua_isnil(L, -1)) {
-                lua_getfield(L, -1, "value");
-                lua_Integer value = lua_tointeger(L, -1);
-                lua_pop(L, 4);
-                memcpy(c_out, &value, size);
-                return;
-            }
+    LuaEventQueue() { type = &tag; }
 
-            lua_pop(L, 3);
-            lua_pushfstring(L, "LuaTypeTo: Enum '%s' field '%s' not registered!", GetLuaTypeinfo(L, type_id).name, name);
-            lua_error(L);
-            return;
+    void Emit(const E &e) { m_events.push_back(e); }
+
+    template <typename... Args>
+    void Emplace(Args &&...args) {
+        m_events.emplace_back(std::forward<Args>(args)...);
+    }
+
+    void Reserve(size_t n) { m_events.reserve(n); }
+
+    size_t Size() const override { return m_events.size(); }
+
+    size_t Fill(lua_State *L, int t, size_t n, size_t used) override {
+        luaL_checkstack(L, 3, "LuaEventQueue: not enough stack slots");
+        if constexpr (detail::LuaStructType<E>) {
+            const char *type_name = reflection::GetTypeName<E>();
+            luaL_getmetatable(L, type_name);
+            int mt = lua_gettop(L);
+            for (size_t i = 0; i < n; ++i) {
+                E *slot = nullptr;
+                if (i < used) {
+                    if (lua_rawgeti(L, t, (lua_Integer)i + 1) == LUA_TUSERDATA && lua_getmetatable(L, -1)) {
+                        auto *ref = (LUASTRUCT_CDATA *)lua_touserdata(L, -2);
+                        if (lua_rawequal(L, -1, mt) && ref->ref == LUA_NOREF) {
+                            slot = (E *)(ref + 1);  // 仍被批次表引用 弹栈后依然有效
+                        }
+                        lua_pop(L, 1);
+                    }
+                    lua_pop(L, 1);
+                }
+                if (slot != nullptr) {
+                    *slot = m_events[i];
+                } else {
+                    LuaStructPush<E>(L, m_events[i]);
+                    lua_rawseti(L, t, (lua_Integer)i + 1);
+                }
+            }
+            lua_pop(L, 1);
+            return std::max(n, used);  // 多出的 userdata 留作下次复用
+        } else {
+            for (size_t i = 0; i < n; ++i) {
+                detail::PushValue(L, m_events[i]);
+                lua_rawseti(L, t, (lua_Integer)i + 1);
+            }
+            for (size_t i = n; i < used; ++i) {
+                lua_pushnil(L);
+                lua_rawseti(L, t, (lua_Integer)i + 1);
+            }
+            return n;
         }
+    }
 
-        lua_pop(L, 3);
-        lua_pushfstring(L, "LuaTypeTo: Enum '%s' not registered!", GetLuaTypeinfo(L, type_id).name);
-        lua_error(L);
-        return;
+    void Consume(size_t n) override { m_events.erase(m_events.begin(), m_events.begin() + (std::ptrdiff_t)n); }
+
+private:
+    std::vector<E> m_events;
+};
+
+// 取得名为 name 的事件队列 保存返回的引用可避免每次 Emit 的查找
+// 例: auto &hits = LuaEvents<HitEvent>(L, "hit"); hits.Emit({...}); vm.FlushEvents();
+template <typename E>
+LuaEventQueue<E> &LuaEvents(lua_State *L, const char *name) {
+    LuaVMData::EventChannel &ch = GetLuaVMData(L).Channel(name);
+    if (!ch.queue) {
+        ch.queue = std::make_unique<LuaEventQueue<E>>();
     }
+    if (ch.queue->type != &LuaEventQueue<E>::tag) {
+        luaL_error(L, "event queue '%s' registered with another type", name);
+    }
+    return *static_cast<LuaEventQueue<E> *>(ch.queue.get());
+}
 
-    lua_pushfstring(L, "LuaTypeTo: conversion from Lua object to type '%s' not registered!", GetLuaTypeinfo(L, type_id).name);
-    lua_error(L);
+// 订阅位于 idx 的函数 返回订阅 id
+inline u32 LuaEventSubscribe(lua_State *L, const char *name, int idx, int priority = 0) {
+    luaL_checktype(L, idx, LUA_TFUNCTION);
+    LuaVMData &vm = GetLuaVMData(L);
+    LuaVMData::EventChannel &ch = vm.Channel(name);
+    lua_pushvalue(L, idx);
+    LuaVMData::EventSubscriber sub{luaL_ref(L, LUA_REGISTRYINDEX), priority, vm.event_next_id++};
+    auto &list = ch.flushing ? ch.pending : ch.subs;
+    auto pos = std::upper_bound(list.begin(), list.end(), priority, [](int p, const LuaVMData::EventSubscriber &s) { return p > s.priority; });
+    list.insert(pos, sub);
+    return sub.id;
+}
+
+inline bool LuaEventUnsubscribe(lua_State *L, const char *name, u32 id) {
+    LuaVMData &vm = GetLuaVMData(L);
+    auto it = vm.events.find(name);
+    if (it == vm.events.end()) {
+        return false;
+    }
+    LuaVMData::EventChannel &ch = it->second;
+    for (auto *list : {&ch.subs, &ch.pending}) {
+        for (auto s = list->begin(); s != list->end(); ++s) {
+            if (s->id != id || s->ref == LUA_NOREF) continue;
+            luaL_unref(L, LUA_REGISTRYINDEX, s->ref);
+            if (ch.flushing && list == &ch.subs) {
+                s->ref = LUA_NOREF;  // 分发中不移动元素
+                ch.dirty = true;
+            } else {
+                list->erase(s);
+            }
+            return true;
+        }
+    }
+    return false;
 }
 
-inline void VaradicLuaPush(lua_State *L) {}
+inline int LuaEventFlush(lua_State *L) {
+    LuaVMData &vm = GetLuaVMData(L);
+    int dispatched = 0;
+    for (size_t c = 0; c < vm.event_order.size(); ++c) {
+        LuaVMData::EventChannel &ch = *vm.event_order[c];
+        size_t n = ch.queue ? ch.queue->Size() : 0;
+        if (n == 0 || ch.flushing) {  // 订阅者内再次 flush 时跳过正在分发的通道
+            continue;
+        }
+        if (ch.subs.empty()) {
+            ch.queue->Consume(n);
+            continue;
+        }
+        luaL_checkstack(L, 4, "LuaEventFlush: not enough stack slots");
+        if (ch.batch_ref == LUA_NOREF) {
+            lua_createtable(L, (int)n, 0);
+            ch.batch_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ch.batch_ref);
+        int t = lua_gettop(L);
+        ch.batch_used = ch.queue->Fill(L, t, n, ch.batch_used);
+        ch.flushing = true;
+        for (size_t i = 0; i < ch.subs.size(); ++i) {
+            if (ch.subs[i].ref == LUA_NOREF) continue;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, ch.subs[i].ref);
+            lua_pushvalue(L, t);
+            lua_pushinteger(L, (lua_Integer)n);
+            luax_pcall(L, 2, 0);  // 单个订阅者出错不影响其他订阅者
+        }
+        ch.flushing = false;
+        lua_pop(L, 1);
+        ch.queue->Consume(n);
+        dispatched += (int)n;
 
-template <typename T, typename... Args>
-inline void VaradicLuaPush(lua_State *L, T &&v, Args &&...args) {
-    using U = std::decay_t<T>;  // 确保 T 不是引用类型
-    if constexpr (std::is_aggregate_v<U>) {
-        bool isLuaStruct = LuaTypeIsStruct(L, LuaType<U>(L));
-        if (isLuaStruct) {
-            LuaStructPush<U>(L, v);
-        } else {  // 未经过注册的聚合类
-            assert(!"use LuaPushRaw");
+        if (ch.dirty) {
+            std::erase_if(ch.subs, [](const LuaVMData::EventSubscriber &s) { return s.ref == LUA_NOREF; });
+            ch.dirty = false;
         }
-    } else {
-        LuaPush<U>(L, std::forward<T>(v));
+        for (auto &sub : ch.pending) {
+            auto pos = std::upper_bound(ch.subs.begin(), ch.subs.end(), sub.priority, [](int p, const LuaVMData::EventSubscriber &s) { return p > s.priority; });
+            ch.subs.insert(pos, sub);
+        }
+        ch.pending.clear();
     }
-    VaradicLuaPush(L, std::forward<Args>(args)...);
+    return dispatched;
 }
 
-template <typename R, typename... Args>
-R InvokeLua(lua_State *L, const char *name, Args... args) {
-    lua_getglobal(L, name);
-    if (!lua_isfunction(L, -1)) {
-        lua_pushstring(L, "not a function\n");
-        lua_error(L);
+// 在 VM 所在线程调用 取出已完成的异步操作并恢复对应的协程
+// 已结束 (例如被 coroutine.close) 的协程跳过 协程中的错误带 traceback 返回给调用方
+// 恢复后协程若以普通 coroutine.yield 挂起 这些值没有接收方 丢弃并作为错误返回
+inline LuaAsyncPollResult LuaAsyncPoll(lua_State *L) {
+    LuaVMData &vm = GetLuaVMData(L);
+    std::vector<LuaAsyncQueue::Completion> done;
+    {
+        std::lock_guard lock(vm.async->mutex);
+        done.swap(vm.async->done);
     }
-    VaradicLuaPush(L, args...);
-    const auto size = sizeof...(args);
-    lua_pcall(L, size, 1, 0);
-    R ret = LuaGet<R>(L, -1);
-    lua_pop(L, 1);
-    return ret;
+    LuaAsyncPollResult result;
+    for (auto &c : done) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, c.thread_ref);
+        lua_State *co = lua_tothread(L, -1);
+        lua_pop(L, 1);
+        luaL_unref(L, LUA_REGISTRYINDEX, c.thread_ref);
+        --vm.async_pending;
+        if (co == nullptr || lua_status(co) != LUA_YIELD) {
+            continue;
+        }
+        if (!lua_checkstack(co, 8)) {  // 挂起的协程没有保护 不在其上抛错
+            result.errors.push_back({LUA_ERRMEM, "LuaAsyncPoll: not enough stack slots"});
+            continue;
+        }
+        int nargs = c.push(co);
+        int nres = 0;
+        detail::async_resuming = co;
+        detail::async_resume_nargs = nargs;
+        int status = LUA_OK;
+        {
+            detail::BudgetResumeHook scope(L, co);
+            status = lua_resume(co, L, nargs, &nres);
+        }
+        detail::async_resuming = nullptr;
+        ++result.resumed;
+        if (status == LUA_OK || status == LUA_YIELD) {
+            if (status == LUA_YIELD && !(nres == 1 && lua_touserdata(co, -1) == &detail::async_yield_tag)) {
+                result.errors.push_back({LUA_YIELD, "coroutine yielded " + std::to_string(nres) + " value(s) outside an async call after being resumed by LuaAsyncPoll"});
+            }
+            lua_pop(co, nres);
+        } else {
+            luaL_traceback(L, co, luaL_tolstring(co, -1, nullptr), 0);
+            result.errors.push_back({status, lua_tostring(L, -1)});
+            lua_pop(L, 1);
+            lua_pop(co, 2);
+        }
+    }
+    return result;
+}
+
+// Lua 侧接口 events.subscribe(name, fn[, priority]) -> id / events.unsubscribe(name, id) / events.flush()
+inline int LuaEventsOpen(lua_State *L) {
+    luaL_Reg lib[] = {
+            {"subscribe",
+             [](lua_State *L) -> int {
+                 const char *name = luaL_checkstring(L, 1);
+                 int priority = (int)luaL_optinteger(L, 3, 0);
+                 lua_pushinteger(L, LuaEventSubscribe(L, name, 2, priority));
+                 return 1;
+             }},
+            {"unsubscribe",
+             [](lua_State *L) -> int {
+                 lua_pushboolean(L, LuaEventUnsubscribe(L, luaL_checkstring(L, 1), (u32)luaL_checkinteger(L, 2)));
+                 return 1;
+             }},
+            {"flush",
+             [](lua_State *L) -> int {
+                 lua_pushinteger(L, LuaEventFlush(L));
+                 return 1;
+             }},
+            {NULL, NULL},
+    };
+    luaL_newlib(L, lib);
+    return 1;
 }
 
 struct callfunc {
@@ -6,50 +6,143 @@ void luax_get(lua_State *L, const_str tb, const_str field) {
     lua_remove(L, -2);
 }
 
-void luax_pcall(lua_State *L, i32 args, i32 results) {
-    if (lua_pcall(L, args, results, 1) != LUA_OK) {
+static const int g_lua_msgh_key = 0;  // 仅用其地址作为注册表键
+
+int luax_msgh(lua_State *L) {
+    const char *msg = lua_tostring(L, 1);
+    if (msg == NULL) {
+        if (luaL_callmeta(L, 1, "__tostring") && lua_type(L, -1) == LUA_TSTRING) {
+            return 1;
+        }
+        msg = lua_pushfstring(L, "(error object is a %s value)", luaL_typename(L, 1));
+    }
+    luaL_traceback(L, L, msg, 1);
+    return 1;
+}
+
+void luax_pushmsgh(lua_State *L) {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &g_lua_msgh_key) != LUA_TFUNCTION) {
+        // 首次调用时安装默认处理函数
         lua_pop(L, 1);
+        lua_pushcfunction(L, luax_msgh);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &g_lua_msgh_key);
     }
 }
 
-int g_lua_callbacks_table_ref;  // LUA_NOREF
+void luax_setmsgh(lua_State *L, int idx) {
+    luaL_checktype(L, idx, LUA_TFUNCTION);
+    lua_pushvalue(L, idx);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &g_lua_msgh_key);
+}
 
-int __neko_bind_callback_save(lua_State *L) {
-    const_str identifier = luaL_checkstring(L, 1);
-    luaL_checktype(L, 2, LUA_TFUNCTION);
-    if (g_lua_callbacks_table_ref == LUA_NOREF) {
+int luax_xpcall(lua_State *L, i32 args, i32 results) {
+    int base = lua_gettop(L) - args;  // 被调用函数所在位置
+    luax_pushmsgh(L);
+    lua_insert(L, base);
+    int status = lua_pcall(L, args, results, base);
+    lua_remove(L, base);
+    return status;
+}
+
+int luax_pcall(lua_State *L, i32 args, i32 results) {
+    int status = luax_xpcall(L, args, results);
+    if (status != LUA_OK) {
+#if LUA_VERSION_NUM >= 504
+        // 交给 VM 的警告函数 (默认关闭 "@on" 或 lua_setwarnf 后可见) 不直接写标准输出
+        lua_warning(L, luaL_tolstring(L, -1, NULL), 0);
+        lua_pop(L, 2);
+#else
+        lua_pop(L, 1);
+#endif
+        if (results != LUA_MULTRET) {
+            luaL_checkstack(L, results, "not enough stack slots");
+            for (int i = 0; i < results; ++i) {
+                lua_pushnil(L);
+            }
+        }
+    }
+    return status;
+}
+
+static const int g_lua_callbacks_key = 0;  // 仅用其地址作为注册表键
+
+// 每个 VM 一张回调表 句柄即数组下标 空闲句柄由 luaL_ref 的空闲链表复用
+static void luax_pushcallbacks(lua_State *L) {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &g_lua_callbacks_key) != LUA_TTABLE) {
+        lua_pop(L, 1);
         lua_newtable(L);
-        g_lua_callbacks_table_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &g_lua_callbacks_key);
+    }
+}
+
+int luax_callback_ref(lua_State *L, int idx) {
+    if (lua_type(L, idx) != LUA_TFUNCTION) {
+        return LUA_NOREF;
     }
-    lua_rawgeti(L, LUA_REGISTRYINDEX, g_lua_callbacks_table_ref);
-    lua_pushvalue(L, 2);
-    lua_setfield(L, -2, identifier);
+    idx = lua_absindex(L, idx);
+    luax_pushcallbacks(L);
+    lua_pushvalue(L, idx);
+    int handle = luaL_ref(L, -2);
     lua_pop(L, 1);
+    return handle;
+}
+
+void luax_callback_unref(lua_State *L, int handle) {
+    if (handle <= 0) {
+        return;
+    }
+    luax_pushcallbacks(L);
+    if (lua_rawgeti(L, -1, handle) == LUA_TFUNCTION) {  // 避免重复释放破坏空闲链表
+        luaL_unref(L, -2, handle);
+    }
     lua_pop(L, 2);
-    return 0;
 }
 
-int __neko_bind_callback_call(lua_State *L) {
-    if (g_lua_callbacks_table_ref != LUA_NOREF) {
-        const_str identifier = luaL_checkstring(L, 1);
-        lua_rawgeti(L, LUA_REGISTRYINDEX, g_lua_callbacks_table_ref);
-        lua_getfield(L, -1, identifier);
-        if (lua_isfunction(L, -1)) {
-            int nargs = lua_gettop(L) - 1;  // 获取参数数量 减去标识符参数
-            for (int i = 2; i <= nargs + 1; ++i) {
-                lua_pushvalue(L, i);
-            }
-            lua_call(L, nargs, 0);  // 调用
-        } else {
-            printf("callback with identifier '%s' not found or is not a function", identifier);
-        }
+int luax_callback_push(lua_State *L, int handle) {
+    luax_pushcallbacks(L);
+    int type = handle > 0 ? lua_rawgeti(L, -1, handle) : (lua_pushnil(L), LUA_TNIL);
+    lua_remove(L, -2);
+    if (type != LUA_TFUNCTION) {  // 空闲槽位中存放的是链表下标
         lua_pop(L, 1);
-    } else {
-        printf("callback table is noref");
+        lua_pushnil(L);
+        return LUA_TNIL;
     }
+    return type;
+}
+
+int luax_callback_call(lua_State *L, int handle, i32 args, i32 results) {
+    if (luax_callback_push(L, handle) != LUA_TFUNCTION) {
+        lua_pop(L, args + 1);
+        lua_pushfstring(L, "invalid callback handle %d", handle);
+        return LUA_ERRRUN;
+    }
+    lua_insert(L, -(args + 1));
+    return luax_xpcall(L, args, results);
+}
+
+int __neko_bind_callback_save(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_pushinteger(L, luax_callback_ref(L, 1));
+    return 1;
+}
+
+int __neko_bind_callback_free(lua_State *L) {
+    luax_callback_unref(L, (int)luaL_checkinteger(L, 1));
     return 0;
 }
 
+int __neko_bind_callback_call(lua_State *L) {
+    int handle = (int)luaL_checkinteger(L, 1);
+    if (luax_callback_push(L, handle) != LUA_TFUNCTION) {
+        return luaL_error(L, "invalid callback handle %d", handle);
+    }
+    lua_replace(L, 1);  // 参数原地不动 句柄替换为函数
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    return lua_gettop(L);
+}
+
 bool neko_lua_equal(lua_State *state, int index1, int index2) {
 #if LUA_VERSION_NUM <= 501
     return lua_equal(state, index1, index2) == 1;
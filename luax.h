@@ -213,11 +213,31 @@ void neko_lua_load(lua_State *L, const luaL_Reg *l, const char *name);
 void neko_lua_loadover(lua_State *L, const luaL_Reg *l, const char *name);
 int neko_lua_get_table_pairs_count(lua_State *L, int index);
 
+// 每个 VM 一张回调表 以整数句柄索引
+// 返回句柄 idx 处不是函数时返回 LUA_NOREF
+int luax_callback_ref(lua_State *L, int idx);
+void luax_callback_unref(lua_State *L, int handle);
+// 压入句柄对应的函数 无效句柄压入 nil 返回压入值的类型
+int luax_callback_push(lua_State *L, int handle);
+// 以栈顶 args 个参数调用 失败时错误对象留在栈顶
+int luax_callback_call(lua_State *L, int handle, i32 args, i32 results);
+
+// Lua 侧: save(fn) -> handle, call(handle, ...) -> ..., free(handle)
 int __neko_bind_callback_save(lua_State *L);
 int __neko_bind_callback_call(lua_State *L);
+int __neko_bind_callback_free(lua_State *L);
 
 void luax_get(lua_State *L, const_str tb, const_str field);
-void luax_pcall(lua_State *L, i32 args, i32 results);
+
+// 带 traceback 的错误处理函数 每个 VM 在注册表中缓存一份
+int luax_msgh(lua_State *L);
+void luax_pushmsgh(lua_State *L);
+void luax_setmsgh(lua_State *L, int idx);
+
+// 失败时错误对象留在栈顶 成功时与 lua_pcall 相同
+int luax_xpcall(lua_State *L, i32 args, i32 results);
+// 失败时打印错误并以 nil 补齐 results 个返回值 保证栈平衡
+int luax_pcall(lua_State *L, i32 args, i32 results);
 
 template <typename F>
 inline void luax_package_preload(lua_State *L, const_str name, F function) {
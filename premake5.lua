@@ -43,7 +43,21 @@ do
 
     includedirs {"."}
 
-    files {"*.hpp", "*.h", "*.cpp"}
+    files {"*.hpp", "*.h", "test.cpp", "luax.cpp"}
 
     files {"premake5.lua"}
+end
+
+project "nekolua_bench"
+do
+    kind "ConsoleApp"
+    language "C++"
+    targetdir "./bin"
+    debugdir "./bin"
+
+    defines("NEKO_CFFI")
+
+    includedirs {"."}
+
+    files {"*.hpp", "*.h", "bench.cpp", "luax.cpp"}
 end
\ No newline at end of file
@@ -1,5 +1,9 @@
 #include <chrono>
+#include <coroutine>
+#include <filesystem>
+#include <functional>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <thread>
 
@@ -281,6 +285,110 @@ static int LuaStruct_test_rawarr(lua_State *L) {
     return 1;
 }
 
+static f64 TestBind_lerp(f64 a, f64 b, f64 t) { return a + (b - a) * t; }
+
+static std::string TestBind_concat(const std::string &a, std::string_view b, int n) {
+    std::string s = a;
+    for (int i = 0; i < n; i++) s.append(b);
+    return s;
+}
+
+static std::tuple<int, int> TestBind_divmod(int a, int b) { return {a / b, a % b}; }
+
+static void TestBind_struct(TestStruct &v, f32 d) { v.x += d; }
+
+static bool TestBind_enum(TestEnum e) { return e == TestEnum_B; }
+
+static TestStruct2 TestBind_lerp2(const TestStruct2 &a, const TestStruct2 &b, f64 t) {
+    return {(int)TestBind_lerp(a.x1, b.x1, t), (int)TestBind_lerp(a.x2, b.x2, t), t < 0.5 ? a.x3 : b.x3};
+}
+
+static f64 TestBind_clamp(f64 v, f64 lo, f64 hi) { return v < lo ? lo : (v > hi ? hi : v); }
+
+static f64 TestBind_clamp01(f64 v) { return TestBind_clamp(v, 0.0, 1.0); }
+
+struct TestRawPoint {
+    int x, y;
+};
+
+struct TestSnapName {
+    int id;
+    const char *name;
+};
+
+template <>
+struct neko::luabind::is_lua_struct<TestRawPoint> : std::false_type {};
+
+static LuaResult<int> TestBind_parse(std::string_view s) {
+    int v = 0;
+    for (char c : s) {
+        if (c < '0' || c > '9') return LuaError{LUA_ERRRUN, "not a number: " + std::string(s)};
+        v = v * 10 + (c - '0');
+    }
+    return v;
+}
+
+static int TestBind_fail(lua_State *L) {
+    std::string owned = "owned by a C++ frame";
+    if (!lua_isnumber(L, 1)) {
+        return LuaFail(L, "expected number (%s)", owned.c_str());
+    }
+    lua_pushnumber(L, lua_tonumber(L, 1) * 2);
+    return 1;
+}
+
+#if NEKO_LUA_EXCEPTIONS
+static int TestBind_throw(lua_State *) { throw std::runtime_error("thrown from C++"); }
+#endif
+
+class TestClass {
+public:
+    TestClass(int w, std::string name) : m_w(w), m_name(std::move(name)) { ++s_live; }
+    TestClass(const TestClass &o) : m_w(o.m_w), m_name(o.m_name) { ++s_live; }
+    ~TestClass() { --s_live; }
+
+    int Area(int h) const { return m_w * h; }
+    int GetWidth() const { return m_w; }
+    void SetWidth(int w) { m_w = w; }
+    const std::string &GetName() const { return m_name; }
+    bool Same(const TestClass &o) const { return m_w == o.m_w && m_name == o.m_name; }
+    TestClass Clone() const { return *this; }
+
+    static int Live() { return s_live; }
+
+    int tag = 0;
+
+private:
+    int m_w;
+    std::string m_name;
+    static inline int s_live = 0;
+};
+
+template <>
+struct neko::luabind::is_lua_class<TestClass> : std::true_type {};
+
+// 最简的立即执行 C++ 协程 用于测试 LuaTask::Next
+struct TestCoro {
+    struct promise_type {
+        TestCoro get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() {}
+    };
+};
+
+static TestCoro TestTask_drive(LuaTask &task, int &sum) {
+    while (!task.Done()) {
+        auto v = co_await task.Next<int>(sum);
+        if (!v) {
+            std::cout << "task error " << v.error().msg << std::endl;
+            co_return;
+        }
+        sum += *v;
+    }
+}
+
 int main() {
 
     // std::cout << neko::reflection::field_count<TestStruct_RawArr> << std::endl;
@@ -293,6 +401,8 @@ int main() {
 
     lua_State *L = vm;
 
+    lua_warning(L, "@on", 0);  // luax_pcall 捕获的错误经警告函数输出
+
     lua_atpanic(
             L, +[](lua_State *L) {
                 auto msg = lua_tostring(L, -1);
@@ -313,6 +423,18 @@ int main() {
     LuaStruct<TestStruct_WithOp>(L, "TestStruct_WithOp");
     lua_setglobal(L, "LuaStruct");
 
+    lua_newtable(L);
+    LuaClass<TestClass>(L, "TestClass")
+            .Constructor<int, std::string>()
+            .Method<&TestClass::Area>("Area")
+            .Method<&TestClass::Same>("Same")
+            .Method<&TestClass::Clone>("Clone")
+            .Property<&TestClass::GetWidth, &TestClass::SetWidth>("width")
+            .Property<&TestClass::GetName>("name")
+            .Property<&TestClass::tag>("tag")
+            .StaticFunction<&TestClass::Live>("Live");
+    lua_setglobal(L, "LuaClass");
+
     luaL_Reg lib[] = {{"LuaStruct_test_1", Wrap<LuaStruct_test_1>},
                       {"LuaStruct_test_2", Wrap<LuaStruct_test_2>},
                       {"LuaStruct_test_3", Wrap<LuaStruct_test_3>},
@@ -342,8 +464,188 @@ int main() {
         lua_register(L, f.name, f.func);
     }
 
+    lua_register(L, "TestBind_lerp", Bind<&TestBind_lerp>());
+    lua_register(L, "TestBind_concat", Bind<&TestBind_concat>());
+    lua_register(L, "TestBind_divmod", Bind<&TestBind_divmod>());
+    lua_register(L, "TestBind_struct", Bind<&TestBind_struct>());
+    lua_register(L, "TestBind_enum", Bind<&TestBind_enum>());
+    lua_register(L, "TestBind_lerp_any", (BindOverloads<&TestBind_lerp, &TestBind_lerp2>()));
+    lua_register(L, "TestBind_clamp", (BindOverloads<&TestBind_clamp, &TestBind_clamp01>()));
+    lua_register(L, "TestBind_parse", Bind<&TestBind_parse>());
+    lua_register(L, "TestBind_fail", Wrap<TestBind_fail>);
+
+    int closure_hits = 0;
+    LuaPushClosure(L, [&closure_hits](int n) { closure_hits += n; });
+    lua_setglobal(L, "TestClosure_hit");
+    LuaPushClosure(L, [prefix = std::string("closure: ")](std::string_view s) { return prefix + std::string(s); });
+    lua_setglobal(L, "TestClosure_prefix");
+    LuaPushClosure(L, [](lua_State *L) -> int {
+        lua_pushinteger(L, lua_gettop(L));
+        return 1;
+    });
+    lua_setglobal(L, "TestClosure_nargs");
+    TestClass closure_obj(5, "bound");
+    LuaPushClosure(L, &closure_obj, &TestClass::Area);
+    lua_setglobal(L, "TestClosure_area");
+#if NEKO_LUA_EXCEPTIONS
+    lua_register(L, "TestBind_throw", Wrap<TestBind_throw>);
+#endif
+
     vm.RunString(table_show_src);
 
+    {
+        // 参数包: 枚举按名字 注册的结构体为 LuaStruct 未注册的聚合类为表
+        vm.RunString(R"lua(
+        function test_varadic(e, s, p, n, str)
+            return e .. ":" .. s.x .. ":" .. (p.x + p.y) .. ":" .. n .. str
+        end
+    )lua");
+        auto r = InvokeLua<std::string>(L, "test_varadic", TestEnum_B, TestStruct{1.5f, 0, 0, 0, 0, 0}, TestRawPoint{2, 3}, 4, "!");
+        std::cout << "varadic " << r << std::endl;
+    }
+
+    {
+        // LuaTask: 从 C++ 逐步驱动 Lua 协程 线程结束后回到池中复用
+        vm.RunString(R"lua(
+        function task_counter(n)
+            for i = 1, n do n = coroutine.yield(i) end
+            return -1
+        end
+        function task_fail() coroutine.yield(1) error("task failed") end
+    )lua");
+        lua_State *first = nullptr;
+        for (int round = 0; round < 2; ++round) {
+            LuaTask task = std::move(*LuaTask::FromGlobal(L, "task_counter"));
+            if (round == 0) first = task.Thread();
+            std::vector<int> got;
+            for (int arg = 3; !task.Done(); ++arg) {
+                auto v = task.Resume<int>(arg);
+                if (v) got.push_back(*v);
+            }
+            std::cout << "task round " << round << " reused " << (task.Thread() == first) << " yields " << got.size() << std::endl;
+        }
+        LuaTask failing = std::move(*LuaTask::FromGlobal(L, "task_fail"));
+        auto r1 = failing.Resume<int>();
+        auto r2 = failing.Resume<int>();
+        std::cout << "task fail " << *r1 << " " << (!r2 ? r2.error().msg : "") << std::endl;
+
+        LuaTask driven = std::move(*LuaTask::FromGlobal(L, "task_counter"));
+        auto missing = LuaTask::FromGlobal(L, "task_missing");
+        std::cout << "task missing " << missing.error().msg << std::endl;
+        int sum = 2;
+        TestTask_drive(driven, sum);
+        std::cout << "task driven sum " << sum << " pool " << GetLuaVMData(L).thread_pool.size() << std::endl;
+    }
+
+    {
+        // 异步函数: 在协程中调用时挂起 由本地的执行队列完成后经 PollAsync 恢复
+        std::vector<std::function<void()>> async_jobs;
+        LuaPushClosure(L, [&async_jobs](int id) {
+            LuaPromise<std::string> p;
+            async_jobs.push_back([p, id]() mutable { p.Resolve("item" + std::to_string(id)); });
+            return p.GetFuture();
+        });
+        lua_setglobal(L, "async_fetch");
+        LuaPushClosure(L, [&async_jobs]() {
+            LuaPromise<> p;
+            async_jobs.push_back([p]() mutable { p.Reject("request timed out"); });
+            return p.GetFuture();
+        });
+        lua_setglobal(L, "async_fail");
+
+        vm.RunString(R"lua(
+        async_results = {}
+        for i = 1, 3 do
+            coroutine.wrap(function()
+                async_results[#async_results + 1] = async_fetch(i)
+            end)()
+        end
+        coroutine.wrap(function()
+            local ok, err = pcall(async_fail)
+            async_results[#async_results + 1] = tostring(ok) .. " " .. err
+        end)()
+        print("async pending", #async_results, pcall(async_fetch, 0))
+    )lua");
+        for (auto &job : async_jobs) job();
+        async_jobs.clear();
+        LuaAsyncPollResult polled = vm.PollAsync();
+        std::cout << "async resumed " << polled.resumed << " errors " << polled.errors.size() << std::endl;
+        vm.RunString(R"lua(print(table.concat(async_results, ", ")))lua");
+    }
+
+    {
+        // 回调句柄: 注册后按整数句柄分发 支持批量调用
+        lua_register(L, "callback_save", __neko_bind_callback_save);
+        lua_register(L, "callback_call", __neko_bind_callback_call);
+        lua_register(L, "callback_free", __neko_bind_callback_free);
+        vm.RunString(R"lua(
+        callback_sum = 0
+        callback_handle = callback_save(function(a, b) callback_sum = callback_sum + a * b return a + b end)
+        print("callback", callback_handle, callback_call(callback_handle, 2, 3), pcall(callback_call, 9999))
+    )lua");
+        lua_getglobal(L, "callback_handle");
+        int handle = (int)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
+        auto r = LuaCallbackCall<int>(L, handle, 4, 5);
+        std::vector<std::tuple<int, int>> calls = {{1, 1}, {2, 2}, {3, 3}};
+        auto batch = LuaCallbackBatch(L, handle, calls);
+        lua_getglobal(L, "callback_sum");
+        std::cout << "callback " << *r << ' ' << batch.has_value() << ' ' << lua_tointeger(L, -1) << std::endl;
+        lua_pop(L, 1);
+
+        luax_callback_unref(L, handle);
+        luax_callback_unref(L, handle);
+        std::cout << "callback freed " << !LuaCallbackCall(L, handle).has_value() << std::endl;
+    }
+
+    {
+        // 事件批量分发: 每次 flush 每个订阅者只被调用一次
+        LuaEventsOpen(L);
+        lua_setglobal(L, "events");
+        vm.RunString(R"lua(
+        event_log = {}
+        events.subscribe("damage", function(batch, n)
+            local sum = 0
+            for i = 1, n do sum = sum + batch[i] end
+            event_log[#event_log + 1] = "low:" .. sum
+        end, -1)
+        events.subscribe("damage", function(batch, n)
+            event_log[#event_log + 1] = "high:" .. n
+        end, 10)
+        events.subscribe("moved", function(batch, n)
+            local x = 0
+            for i = 1, n do x = x + batch[i].x end
+            event_log[#event_log + 1] = "moved:" .. x
+        end)
+    )lua");
+
+        auto &damage = LuaEvents<int>(L, "damage");
+        auto &moved = LuaEvents<TestStruct>(L, "moved");
+        for (int frame = 0; frame < 2; ++frame) {
+            for (int i = 1; i <= 100; ++i) damage.Emit(i);
+            for (int i = 0; i < 3 - frame; ++i) moved.Emit(TestStruct{(f32)(i + frame), 0, 0, 0, 0, 0});
+            vm.FlushEvents();
+        }
+        vm.RunString(R"lua(print(table.concat(event_log, " ")))lua");
+    }
+
+    {
+        // 两种错误策略下 绑定函数的错误都应成为可被 pcall 捕获的 Lua 错误
+        vm.RunString(R"lua(
+        print(TestBind_parse("42"), pcall(TestBind_parse, "4x2"))
+        print(TestBind_fail(21), pcall(TestBind_fail, "x"))
+        print(pcall(TestBind_lerp, "a", 1, 2), pcall(TestBind_concat, {}, "b", 1))
+        TestClosure_hit(2)
+        TestClosure_hit(3)
+        print(TestClosure_prefix("x"), TestClosure_nargs(1, 2, 3), TestClosure_area(4))
+        if TestBind_throw then
+            print(pcall(TestBind_throw))
+        end
+    )lua");
+        std::cout << "closure_hits " << closure_hits << std::endl;
+    }
+
     {
         vm.RunString(R"lua(
         function hello()
@@ -375,6 +677,97 @@ int main() {
 
         f32 ret = InvokeLua<f32>(L, "test_invoke", "a_str", 114514);
         std::cout << ret << '\n';
+
+        vm.RunString(R"lua(
+        function test_invoke_multi(a, b)
+            return a + b, a * b, "sum and product"
+        end
+        )lua");
+
+        for (int i = 0; i < 3; i++) {
+            auto [sum, product, desc] = InvokeLua<std::tuple<int, int, std::string>>(L, "test_invoke_multi", i, 10);
+            std::cout << sum << ' ' << product << ' ' << desc << '\n';
+        }
+
+        // 按名字调用总是读取当前的全局函数 缓存句柄需要显式失效
+        LuaGlobalFunction cached(L, "test_invoke_multi");
+        vm.RunString("function test_invoke_swap() test_invoke_multi = function(a, b) return a - b, 0, 'swapped' end end");
+        InvokeLua<void>(L, "test_invoke_swap");
+        std::cout << std::get<2>(InvokeLua<std::tuple<int, int, std::string>>(L, "test_invoke_multi", 1, 2)) << '\n';
+        LuaGlobalsChanged(L);
+        std::cout << std::get<2>(*TryInvokeLua<std::tuple<int, int, std::string>>(cached, 1, 2)) << '\n';
+    }
+
+    {
+        vm.RunString(R"lua(
+        function test_invoke_error(a)
+            error("test_invoke_error " .. tostring(a))
+        end
+        )lua");
+
+        int top = lua_gettop(L);
+        auto ret = TryInvokeLua<int>(L, "test_invoke_error", 1);
+        if (!ret) {
+            std::cout << ret.error().msg << '\n';
+        }
+        auto missing = TryInvokeLua<void>(L, "test_invoke_missing");
+        std::cout << missing.error().msg << '\n';
+        assert(lua_gettop(L) == top);
+    }
+
+    {
+        vm.RunString(R"lua(
+        function test_lerp(a, b, t)
+            return a + (b - a) * t
+        end
+        )lua");
+
+        auto lerp = LuaFunction<f64(f64, f64, f64)>::FromGlobal(L, "test_lerp");
+        std::cout << lerp(0.0, 10.0, 0.25).value_or(-1.0) << '\n';
+
+        std::vector<std::tuple<f64, f64, f64>> calls = {{0.0, 1.0, 0.5}, {2.0, 4.0, 0.5}, {-1.0, 1.0, 1.0}};
+        std::vector<f64> results(calls.size());
+        if (lerp.Batch(calls, std::span<f64>(results))) {
+            for (auto r : results) std::cout << r << ' ';
+            std::cout << '\n';
+        }
+
+        auto missing = LuaFunction<void()>::FromGlobal(L, "test_lerp_missing");
+        std::cout << "missing valid " << missing.IsValid() << " error " << missing().error().msg << '\n';
+    }
+
+    {
+        std::vector<int> ints(1000);
+        for (int i = 0; i < (int)ints.size(); i++) ints[i] = i * 2;
+
+        LuaRef arr = LuaRef::FromRange(L, ints);
+        arr.AppendRange(std::span<const int>(ints.data(), 3));
+        arr.Push();
+        std::cout << "arr len " << lua_rawlen(L, -1) << '\n';
+        lua_pop(L, 1);
+
+        std::vector<std::string> strs = {"a", "b", "c"};
+        arr.Assign(strs);
+        arr.Push();
+        lua_setglobal(L, "test_arr");
+        vm.RunString("print(#test_arr, test_arr[1], test_arr[3])");
+    }
+
+    {
+        std::map<int, std::string> cache;
+
+        WeakLuaRef weak;
+        {
+            LuaRef big = LuaRef::NewTable(L, 1024);
+            weak = WeakLuaRef(big);
+            weak.Watch();
+            cache[weak.id()] = "big table";
+            std::cout << "weak expired " << weak.expired() << '\n';
+        }
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        std::cout << "weak expired " << weak.expired() << '\n';
+        WeakLuaRefSweep(L, [&](int id) { cache.erase(id); });
+        std::cout << "cache size " << cache.size() << '\n';
     }
 
     {
@@ -449,8 +842,39 @@ int main() {
         print(test_struct_withop1==test_struct_withop2)
 
         print(nameof(LuaStruct.TestStruct))
+
+        print(TestBind_lerp(0, 10, 0.5), TestBind_concat("a", "b", 3), TestBind_divmod(17, 5))
+        test_struct = LuaStruct.TestStruct.new()
+        TestBind_struct(test_struct, 2.5)
+        print(test_struct.x, TestBind_enum("TestEnum_B"), TestBind_enum(0), pcall(TestBind_enum, "TestEnum_Nope"))
+
+        test_struct2_a = LuaStruct.TestStruct2.new()
+        test_struct2_b = LuaStruct.TestStruct2.new()
+        test_struct2_b.x1 = 10
+        print(TestBind_lerp_any(0, 10, 0.25), TestBind_lerp_any(test_struct2_a, test_struct2_b, 0.5).x1)
+        print(TestBind_clamp(1.5), TestBind_clamp(5, 0, 3), pcall(TestBind_clamp, "x"))
+
+        local test_class = LuaClass.TestClass.new(3, "box")
+        test_class.width = 4
+        test_class.tag = 7
+        print(test_class:Area(2), test_class.width, test_class.name, test_class.tag, test_class:Same(test_class:Clone()), LuaClass.TestClass.Live())
+        print(pcall(function() test_class.name = "x" end), pcall(test_class.Area, test_struct, 1))
+        print(test_class.__gc, test_class.__name, getmetatable(test_class))
     )");
 
+    {
+        // 类属性读写 结果不符时测试失败
+        auto props = vm.RunString(R"lua(
+            local c = LuaClass.TestClass.new(3, "box")
+            c.width = 4
+            c.tag = 7
+            assert(c.width == 4 and c.name == "box" and c.tag == 7 and c:Area(2) == 8, "class properties")
+        )lua",
+                                  LuaBudget{});
+        std::cout << "class properties " << (props ? "ok" : props.error().msg) << std::endl;
+        if (!props) return 1;
+    }
+
     // TestBinding_1(L);
 
     // luaL_dostring(L, "t = {x = 10, y = 'hello', z = {a = 1, b = 2}}");
@@ -468,6 +892,241 @@ int main() {
     // TestStruct3 TestStruct3 = {114514.f, 2.f, 3.f, 4.f, 199, 233};
     // LuaPush(L, TestStruct3);
 
+    {
+        // 沙箱: 共享只读的基础环境 写入只落在各自的沙箱中
+        vm.RunString(R"lua(
+            Counter = setmetatable({count = 0}, {__call = function(cls, n) return cls.count + n end})
+            sandbox_base = {print = print, tostring = tostring, string = string, math = math, Counter = Counter}
+        )lua");
+        lua_getglobal(L, "sandbox_base");
+        int base = vm.SandboxBase(-1);
+        lua_pop(L, 1);
+        vm.NewSandbox(base);
+        vm.NewSandbox(base);
+        vm.RunSandboxed(-2, "x = 1 string.shout = function(s) return s:upper() end print('sandbox a', x, string.shout('a'), string.rep('b', 2))");
+        vm.RunSandboxed(-1, "Counter.count = 5 print('sandbox b', x, string.shout, math.pi > 3, Counter(1))");
+        auto bad = vm.RunSandboxed(-1, "error('tenant failure')");
+        std::cout << "sandbox error " << (!bad ? bad.error().msg.substr(0, bad.error().msg.find('\n')) : "no error") << std::endl;
+        lua_pop(L, 2);
+        vm.RunString("print('sandbox base', string.shout, sandbox_base.x, Counter.count)");
+    }
+
+    {
+        // 热重载: 旧 VM 中的结构体状态按路径写入快照 新 VM 重新注册类型后恢复
+        auto setup = [](lua_State *S) {
+            lua_newtable(S);
+            LuaStruct<TestStruct>(S, "TestStruct");
+            lua_setglobal(S, "LuaStruct");
+        };
+        LuaVM old_vm;
+        lua_State *A = old_vm.Create();
+        setup(A);
+        old_vm.RunString("player = LuaStruct.TestStruct.new() player.x = 7 player.x2 = 42 world = { items = { LuaStruct.TestStruct.new() } } world.items[1].y = 2.5 world.self = world world.out = io.stdout");
+        std::cout << "snapshotable " << LuaStructSnapshotable<TestStruct> << LuaStructSnapshotable<TestSnapName> << std::endl;
+        lua_pushglobaltable(A);
+        std::string snapshot = LuaStructSnapshot(A, -1);
+        lua_pop(A, 1);
+        old_vm.Fini(A);
+
+        LuaVM new_vm;
+        lua_State *B = new_vm.Create();
+        setup(B);
+        new_vm.RunString("player = LuaStruct.TestStruct.new() player.x = 1");
+        lua_pushglobaltable(B);
+        LuaStructRestoreResult restored = LuaStructRestore(B, -1, snapshot);
+        lua_pop(B, 1);
+        std::cout << "snapshot bytes " << snapshot.size() << " restored " << restored.restored << " skipped " << restored.skipped << std::endl;
+        new_vm.RunString("print('snapshot', player.x, player.x2, world.items[1].y)");
+        new_vm.Fini(B);
+    }
+
+    {
+        // 惰性注册: 启动时只记录注册函数 元表与枚举值表在首次使用时生成
+        LuaVM lazy;
+        lua_State *Z = lazy.Create();
+        lua_newtable(Z);
+        LuaStructLazy<TestStruct>(Z, "TestStruct");
+        LuaStructLazy<TestStruct2>(Z, "TestStruct2");
+        lua_setglobal(Z, "LuaStruct");
+        LuaEnumLazy<TestEnum>(Z);
+        auto registered = [Z](const char *name) { return TypeFind(Z, name) != NEKOLUA_INVALID_TYPE; };
+        const char *struct_name = neko::reflection::GetTypeName<TestStruct>();
+        const char *unused_name = neko::reflection::GetTypeName<TestStruct2>();
+        const char *enum_name = neko::reflection::GetTypeName<TestEnum>();
+        std::cout << "lazy before " << registered(struct_name) << registered(enum_name) << std::endl;
+        lazy.RunString("local v = LuaStruct.TestStruct.new() v.x = 3 print('lazy struct', v.x, rawget(LuaStruct, 'TestStruct2'))");
+        TestEnum lazy_value = TestEnum_B;
+        LuaPush<TestEnum>(Z, lazy_value);
+        std::cout << "lazy enum " << lua_tostring(Z, -1) << std::endl;
+        lua_pop(Z, 1);
+        // 命名空间表已有自己的元表时报错
+        lua_pushcfunction(Z, [](lua_State *L) -> int {
+            lua_newtable(L);
+            lua_newtable(L);
+            lua_setmetatable(L, -2);
+            LuaStructLazy<TestStruct2>(L, "TestStruct2");
+            return 0;
+        });
+        if (lua_pcall(Z, 0, 0, 0) != LUA_OK) {
+            std::cout << "lazy foreign metatable " << lua_tostring(Z, -1) << std::endl;
+            lua_pop(Z, 1);
+        }
+        std::cout << "lazy after " << registered(struct_name) << registered(enum_name) << registered(unused_name) << std::endl;
+        lazy.Fini(Z);
+    }
+
+    {
+        // VM 池: 注册只在创建时执行一次 归还时恢复到注册完成后的状态
+        int setups = 0;
+        LuaVMPool pool(
+                [&setups](lua_State *P) {
+                    ++setups;
+                    lua_newtable(P);
+                    LuaStruct<TestStruct>(P, "TestStruct");
+                    lua_setglobal(P, "LuaStruct");
+                },
+                1);
+        std::optional<LuaRef> stale;
+        for (int i = 0; i < 3; ++i) {
+            LuaVM pooled = pool.Acquire();
+            stale.reset();  // 上一次借出时创建 析构时不会释放已属于重置点的槽位
+            stale.emplace(LuaRef::NewTable(pooled.L));
+            pooled.SetMemoryLimit(1 << 30);
+            pooled.RunString(R"lua(
+                print("pool", leaked, string.leaked, getmetatable(_G), LuaStruct.TestStruct ~= nil)
+                leaked = 1
+                string.leaked = 2
+                setmetatable(_G, {})
+                package.loaded.leaked = true
+            )lua");
+            pool.Release(pooled);
+        }
+        stale.reset();
+        std::cout << "pool setups " << setups << " idle " << pool.IdleCount() << std::endl;
+    }
+
+    {
+        // 编译缓存: 相同源码只解析一次 磁盘缓存让新 VM 直接加载字节码
+        std::string snippet = "chunk_runs = (chunk_runs or 0) + 1";
+        vm.SetChunkCache(true, 2);
+        for (int i = 0; i < 3; ++i) vm.RunString(snippet);
+        std::cout << "chunk cache " << GetLuaVMData(L).chunks.size() << std::endl;
+        vm.RunString("print('chunk runs', chunk_runs)");
+        vm.RunString("chunk_runs = chunk_runs + 10");
+        std::cout << "chunk cache capped " << GetLuaVMData(L).chunks.size() << std::endl;
+        vm.SetChunkCache(false);
+
+        std::filesystem::path dir = std::filesystem::temp_directory_path() / "nekolua_chunk_test";
+        std::filesystem::create_directories(dir);
+        for (int i = 0; i < 2; ++i) {
+            LuaVM cold;
+            lua_State *C = cold.Create();
+            cold.SetChunkCacheDir(dir.string());
+            cold.RunString("print('chunk from disk cache', 6 * 7)");
+            cold.Fini(C);
+        }
+        std::error_code ec;
+        std::filesystem::remove_all(dir, ec);
+    }
+
+    {
+        // 后台编译: 工作线程产出字节码 主线程只做 lua_load
+        auto pending = LuaCompileAsync("return ... * 2", "=async_chunk");
+        std::vector<std::pair<std::string, std::string>> mods = {{"=mod_a", "mod_a = 1"}, {"=mod_b", "mod_b = 2"}, {"=mod_bad", "mod_bad = ="}};
+        std::vector<LuaCompiled> compiled = LuaCompileAll(mods);
+        for (const LuaCompiled &c : compiled) {
+            if (LuaLoadCompiled(L, c) != LUA_OK) {
+                std::cout << "compile failed " << lua_tostring(L, -1) << std::endl;
+                lua_pop(L, 1);
+                continue;
+            }
+            LuaCall(L, 0, 0);
+        }
+        LuaCompiled doubled = pending.get();
+        if (LuaLoadCompiled(L, doubled) == LUA_OK) {
+            lua_pushinteger(L, 21);
+            LuaCall(L, 1, 1);
+            std::cout << "compiled async " << lua_tointeger(L, -1) << std::endl;
+            lua_pop(L, 1);
+        }
+        size_t cached = GetLuaVMData(L).chunks.size();
+        if (LuaLoadCached(L, "mod_a = 1", "=mod_a") == LUA_OK) lua_pop(L, 1);
+        std::cout << "compiled cache hit " << (GetLuaVMData(L).chunks.size() == cached) << std::endl;
+        vm.RunString("print('compiled mods', mod_a, mod_b, mod_bad)");
+    }
+
+    {
+        // 执行预算: 死循环在指令或时间预算耗尽后中止 脚本中的 pcall 吞不掉
+        auto spin = vm.RunString("while true do pcall(function() while true do end end) end", LuaBudget{.instructions = 1000000});
+        std::cout << "budget instructions " << (!spin ? spin.error().msg.substr(0, spin.error().msg.find('\n')) : "no error") << std::endl;
+        auto slow = vm.RunString("local x = 0 while true do x = x + 1 end", LuaBudget{.time_ms = 5});
+        std::cout << "budget time " << (!slow ? slow.error().msg.substr(0, slow.error().msg.find('\n')) : "no error") << std::endl;
+        auto fine = vm.RunString("local x = 0 for i = 1, 100 do x = x + i end", LuaBudget{.instructions = 1000000, .time_ms = 100});
+        std::cout << "budget ok " << (bool)fine << std::endl;
+        // 预算之前创建的协程与 LuaTask 同样受预算约束
+        vm.RunString("budget_co = coroutine.create(function() while true do end end)");
+        auto co = vm.RunString("coroutine.resume(budget_co)", LuaBudget{.instructions = 100000});
+        std::cout << "budget old coroutine " << (!co ? co.error().msg.substr(0, co.error().msg.find('\n')) : "no error") << std::endl;
+        // 替换后的 coroutine.wrap 出错时仍关闭协程 待关闭变量照常执行
+        vm.RunString(R"lua(
+            local closed = false
+            local f = coroutine.wrap(function()
+                local guard <close> = setmetatable({}, {__close = function() closed = true end})
+                error("boom")
+            end)
+            print('wrap close', pcall(f), closed)
+        )lua");
+        vm.RunString("function budget_spin() while true do end end");
+        if (auto task = LuaTask::FromGlobal(L, "budget_spin")) {
+            lua_pushlightuserdata(L, &*task);
+            lua_pushcclosure(
+                    L,
+                    [](lua_State *L) -> int {
+                        auto *t = static_cast<LuaTask *>(lua_touserdata(L, lua_upvalueindex(1)));
+                        lua_pushboolean(L, (bool)t->Resume());
+                        return 1;
+                    },
+                    1);
+            lua_setglobal(L, "budget_task_resume");
+            auto tr = vm.RunString("budget_task_resume()", LuaBudget{.instructions = 100000});
+            std::cout << "budget task " << (!tr ? tr.error().msg.substr(0, tr.error().msg.find('\n')) : "no error") << std::endl;
+        }
+    }
+
+    {
+        // GC 步进: 关闭自动回收 每帧最多 200us
+        LuaVM gcvm;
+        lua_State *G = gcvm.Create();
+        gcvm.SetGCMode(LuaVM::GCMode::Generational);
+        gcvm.SetGCParams(200, 200);  // 分代模式下只记录 不切回增量模式
+        std::cout << "gc still generational " << (lua_gc(G, LUA_GCGEN, 0, 0) == LUA_GCGEN) << std::endl;
+        gcvm.SetGCMode(LuaVM::GCMode::Incremental);
+        gcvm.SetGCManual(true);
+        gcvm.RunString(R"lua(for i = 1, 100000 do local t = {i, tostring(i)} end)lua");
+        int frames = 0;
+        while (!gcvm.GCStep(200) && frames < 10000) ++frames;
+        const LuaGCStats &gs = gcvm.GCStats();
+        std::cout << "gc cycles " << gs.cycles << " frames " << frames << " collected " << (gs.last_collected > 0) << std::endl;
+        gcvm.Fini(G);
+    }
+
+    {
+        // 内存上限: 失控的脚本得到内存错误 VM 仍可继续使用
+        LuaVM limited;
+        lua_State *M = limited.Create();
+        limited.SetMemoryLimit(limited.MemStats().bytes + 256 * 1024);
+        limited.RunString(R"lua(
+            local ok, err = pcall(function()
+                local t = {}
+                for i = 1, 1e7 do t[i] = tostring(i) .. "-payload" end
+            end)
+            print("mem limit", ok, err)
+        )lua");
+        const LuaMemStats &st = limited.MemStats();
+        std::cout << "mem peak " << st.peak << " limit " << st.limit << " failed " << (st.failed > 0) << " small32 " << st.allocs[1] << std::endl;
+        limited.Fini(M);
+    }
+
     std::cout << "======= END =======" << std::endl;
 
     vm.Fini(L);
@@ -45,3 +45,32 @@ do
     set_targetdir("./")
     set_rundir("./")
 end
+
+-- 同一测试以 -fno-exceptions 编译 覆盖无异常的绑定策略
+target("nekolua_noexcept")
+do
+    set_kind("binary")
+    add_headerfiles("**.hpp")
+    add_files("test.cpp", "luax.cpp")
+    add_packages("lua")
+
+    add_defines("NEKO_CFFI")
+    set_exceptions("no-cxx")
+
+    set_targetdir("./")
+    set_rundir("./")
+end
+
+-- 分配器等性能对比 不属于测试
+target("nekolua_bench")
+do
+    set_kind("binary")
+    add_headerfiles("**.hpp")
+    add_files("bench.cpp", "luax.cpp")
+    add_packages("lua")
+
+    add_defines("NEKO_CFFI")
+
+    set_targetdir("./")
+    set_rundir("./")
+end